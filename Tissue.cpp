@@ -1,6 +1,9 @@
 // HivTissue.cpp implementation
 // Copyright (c) 2004-7 David R. Cheriton, All rights reserved.
 
+#include <algorithm>
+#include <map>
+#include <string.h>
 #include "fwk/String.h"
 #include "Tissue.h"
 //----------| AntibodyStrength Implementation |------------//
@@ -168,13 +171,28 @@ CellMembrane::sideIs(CellMembrane::Side _side){
    side_ = _side;
    }
 
+const AntibodyStrength
+CellMembrane::antibodyStrength() const {
+   if(cell_) return cell_->antibodyStrength(side_);
+   return antibodyStrength_;
+}
+
 void
 CellMembrane::antibodyStrengthIs(AntibodyStrength _antibodyStrength)
 {
-	antibodyStrength_ = _antibodyStrength;
+	if(cell_) cell_->antibodyStrengthIs(side_, _antibodyStrength);
+	else antibodyStrength_ = _antibodyStrength;
+}
+
+void
+CellMembrane::cellIs(Cell * _cell) {
+   if(_cell==cell_) return;
+   if(cell_) antibodyStrength_ = cell_->antibodyStrength(side_);
+   // Keep the last strength when detaching from the cell.
+   cell_ = _cell;
 }
 
-CellMembrane::CellMembrane(Fwk::String _name, Side _side): Fwk::NamedInterface(_name),side_(_side),antibodyStrength_(0) {
+CellMembrane::CellMembrane(Fwk::String _name, Side _side): Fwk::NamedInterface(_name),side_(_side),antibodyStrength_(0),cell_(0) {
 }
 
 //----------| Cell Implementation |------------//
@@ -187,6 +205,21 @@ Cell::Coordinates::name() const
 	return n;
 }
 
+Cell::Coordinates
+Cell::Coordinates::CoordinatesInstance( Fwk::String str )
+{
+	Coordinates loc;
+	char open = 0, c1 = 0, c2 = 0, close = 0;
+	Fwk::IstringStream in(str);
+	in >> open >> loc.x >> c1 >> loc.y >> c2 >> loc.z >> close;
+	if( in.fail() || open != '(' || c1 != ',' || c2 != ',' || close != ')' ) {
+		throw Fwk::RangeException( "Cell::Coordinates" );
+	}
+	return loc;
+}
+
+Fwk::String valueToStrep( Cell::Coordinates const & loc ) { return loc.name(); }
+
 void
 Cell::onZeroReferences() {
   retry:
@@ -248,6 +281,18 @@ Cell::NotifieeConst::isNonReferencingIs(bool _isNonReferencing){
    }
    }
 
+void
+Cell::NotifieeConst::onNotification() {
+   U8 membranes = membranesDeferred_;
+   bool tissue = tissueDeferred_;
+   membranesDeferred_ = 0;
+   tissueDeferred_ = false;
+   for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+      if(membranes & (1 << s)) onMembrane(CellMembrane::Side(s));
+   }
+   if(tissue) onTissue();
+}
+
 //----------| Notifiee Implementation |------------//
 
 Fwk::String
@@ -266,7 +311,7 @@ Cell::attributeString( Fwk::RootNotifiee::AttributeId a ) const {
 
 Cell::~Cell() {
    for( U32 i=CellMembrane::north_;i<=CellMembrane::down_;++i) {
-      membraneDel(CellMembrane::Side(i));
+      if(membrane_[i]) membrane_[i]->cellIs(0);
    }
 }
 Cell::HealthId Cell::HealthIdInstance( U32 v ) {
@@ -298,23 +343,76 @@ Cell::HealthId Cell::HealthIdInstance( Fwk::String str ) {
    }
 }
 
+void
+Cell::antibodyStrengthIs(CellMembrane::Side _side, AntibodyStrength _strength) {
+   antibodyStrength_[_side] = _strength;
+   if(tissue_) {
+      // index_ may be moved by another thread's cellDel; read it locked.
+      // Other cells' bytes are theirs, so a shared hold is enough.
+      Tissue::IndexLock index(tissue_, true);
+      if(index_ != noIndex) tissue_->strengthIndex_[_side][index_] = _strength.value();
+   }
+}
+
 void
 Cell::healthIs(Cell::HealthId _health){
    health_ = _health;
+   if(tissue_) {
+      Tissue::IndexLock index(tissue_, true);
+      if(index_ != noIndex) {
+         tissue_->infectedLock();
+         tissue_->infectedIs(index_, _health == infected_);
+         tissue_->infectedUnlock();
+      }
+   }
    }
 
-CellMembrane::Ptr
-Cell::newMembrane( Fwk::String _name, CellMembrane::Side _side ) {
-   CellMembrane::Ptr mem = CellMembrane::CellMembraneNew(_name,_side);
-   membrane_[_side] = mem;
-   return mem;
+CellMembrane *
+Cell::membraneMaterialized( CellMembrane::Side _side ) const {
+   if(!membraneExists(_side)) return 0;
+   CellMembrane::Ptr m = membrane_[_side];
+   if(!m) {
+      m = CellMembrane::CellMembraneNew(name() + " " + stringValue(_side), _side,
+                                        allocatorFor(tissue_));
+      m->cellIs(const_cast<Cell *>(this));
+      membrane_[_side] = m;
+   }
+   return m.ptr();
+}
+
+void
+Cell::membranesMaterialized() const {
+   for( U32 i=CellMembrane::north_;i<=CellMembrane::down_;++i) {
+      membraneMaterialized(CellMembrane::Side(i));
+   }
+}
+
+bool
+Cell::notificationDeferred() const {
+   return tissue_ && tissue_->notificationDeferred();
+}
+
+void
+Cell::notificationDeferredNew(NotifieeConst::AttributeId _aid, U8 _membranes,
+                              Tissue * _tissue) {
+   for(NotifieeIterator n=notifieeIter();n.ptr();++n) {
+      n->membranesDeferred_ |= _membranes;
+      if(_aid == NotifieeConst::tissue__) n->tissueDeferred_ = true;
+      _tissue->deferred_.notifieeNew(n.ptr(), _aid);
+   }
 }
 
 CellMembrane::Ptr
 Cell::membraneDel(CellMembrane::Side _side) {
-   CellMembrane::Ptr m = membrane_[_side-0];
-   membrane_[_side-0] = 0;
+   CellMembrane::Ptr m = membraneMaterialized(_side);
    if(!m) return 0;
+   m->cellIs(0);
+   membrane_[_side-0] = 0;
+   membraneExists_ &= ~(1 << _side);
+   if(notificationDeferred()) {
+      notificationDeferredNew(NotifieeConst::membrane__, 1 << _side, tissue_);
+      return m;
+   }
    retrymembraneDel:
    U32 ver = notifiee_.version();
    if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
@@ -324,14 +422,14 @@ Cell::membraneDel(CellMembrane::Side _side) {
    return m;
 }
 
-CellMembrane::Ptr
-Cell::membraneNew(Fwk::String _name,CellMembrane::Side _side) {
-   CellMembrane::Ptr m = membrane_[_side-0];
-   if(m) {
-      if(m->name()!=_name) throw Fwk::NameInUseException(_name);
-      return m;
-   } else {
-      m = newMembrane(_name,_side);
+void
+Cell::membraneNew(CellMembrane::Side _side, AntibodyStrength _strength) {
+   if(membraneExists(_side)) throw Fwk::NameInUseException(stringValue(_side));
+   antibodyStrengthIs(_side, _strength);
+   membraneExists_ |= (1 << _side);
+   if(notificationDeferred()) {
+      notificationDeferredNew(NotifieeConst::membrane__, 1 << _side, tissue_);
+      return;
    }
    retrymembrane:
    U32 ver = notifiee_.version();
@@ -339,13 +437,18 @@ Cell::membraneNew(Fwk::String _name,CellMembrane::Side _side) {
       n->onMembrane(_side);
       if( ver != notifiee_.version() ) goto retrymembrane;
    } catch(...) { n->onNotificationException(NotifieeConst::membrane__); }
-   return m;
 }
 
 void
 Cell::tissueIs(Tissue * _tissue){
    if(_tissue==tissue_) return;
+   // A cell leaving its tissue is reported through that tissue's queue.
+   Tissue * notifier = _tissue ? _tissue : tissue_;
    tissue_ = _tissue;
+   if(notifier->notificationDeferred()) {
+      notificationDeferredNew(NotifieeConst::tissue__, 0, notifier);
+      return;
+   }
    retrytissue:
    U32 ver = notifiee_.version();
    if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
@@ -354,12 +457,26 @@ Cell::tissueIs(Tissue * _tissue){
    } catch(...) { n->onNotificationException(NotifieeConst::tissue__); }
    }
 
+Fwk::SlabAllocator *
+Cell::allocatorFor(Tissue * _tissue) {
+   // The slab allocator is not thread-safe, so cells of a sharded tissue,
+   // which may be made on several threads at once, come from the heap.
+   if(!_tissue || _tissue->cellStorage() == Tissue::shardedStorage()) return 0;
+   return _tissue->allocator().ptr();
+}
+
 Cell::Cell(Coordinates _loc, Tissue * _tissue, Cell::CellType _type):
-      Fwk::NamedInterface(_loc.name()),
+      Fwk::NamedInterface(Fwk::String()),
       location_(_loc),
       health_(healthy_),
+      membraneExists_(0),
       tissue_(_tissue),
-      cellType_(_type){
+      cellType_(_type),
+      index_(noIndex),
+      infectionClaim_(0){
+   for( U32 i=CellMembrane::north_;i<=CellMembrane::down_;++i) {
+      neighbor_[i] = 0;
+   }
 }
 
 //----------| Tissue Implementation |------------//
@@ -424,6 +541,15 @@ Tissue::NotifieeConst::isNonReferencingIs(bool _isNonReferencing){
    }
    }
 
+void
+Tissue::NotifieeConst::onNotification() {
+   CellVector added, removed;
+   added.swap(cellsNewDeferred_);
+   removed.swap(cellsDelDeferred_);
+   if(!added.empty()) onCellsNew(added);
+   if(!removed.empty()) onCellsDel(removed);
+}
+
 //----------| Notifiee Implementation |------------//
 
 Fwk::String
@@ -439,6 +565,16 @@ Tissue::attributeString( Fwk::RootNotifiee::AttributeId a ) const {
 }
 
 
+Tissue::CellStorage Tissue::CellStorageInstance( Fwk::String str ) {
+   if( 0 ) {
+   } else if( str == "hashed" ) { return hashedStorage_;
+   } else if( str == "chunked" ) { return chunkedStorage_;
+   } else if( str == "sharded" ) { return shardedStorage_;
+   } else {
+      throw Fwk::RangeException( "CellStorage" );
+   }
+}
+
 Tissue::~Tissue() {
   CellIterator i = cellIter();
    while(i.ptr())
@@ -446,32 +582,131 @@ Tissue::~Tissue() {
 	 cellDel(i->fwkKey());
 	 i = cellIter();
    }
+   pthread_rwlock_destroy(&indexLock_);
+   pthread_mutex_destroy(&infectedLock_);
 }
 
 Cell::Ptr
 Tissue::cellDel(Fwk::String _name) {
-   Cell::Ptr m = cell_.deleteMember(_name);
-   if(!m) return 0;
+   Cell::Coordinates loc;
+   try {
+      loc = Cell::Coordinates::CoordinatesInstance(_name);
+   } catch(Fwk::RangeException &) {
+      return 0;
+   }
+   return cellDel(loc);
+}
+
+Cell::Ptr
+Tissue::cellDel(Cell::Coordinates _loc) {
+   Cell::Ptr m;
+   bool queued;
+   {
+      ShardLock lock(this, _loc);
+      m = cellMemberDel(_loc);
+      if(!m) return 0;
+      neighborsUnlink(m.ptr());
+      IndexLock index(this);
+      cellIndexDel(m.ptr());
+      queued = notificationBatches_ || notificationDeferred_;
+      if(notificationBatches_) cellsDelPending_.push_back(m);
+      else if(notificationDeferred_) cellsDelDeferred(CellVector(1, m));
+   }
+   // Notifiees are called with no lock held, so they may change the
+   // tissue in turn.
    m->tissueIs(0);
+   if(queued) return m;
    retrycellDel:
    U32 ver = notifiee_.version();
    if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
-      n->onCellDel(_name);
+      n->onCellDel(m->name());
       n->onCellDel(m);
       if( ver != notifiee_.version() ) goto retrycellDel;
    } catch(...) { n->onNotificationException(NotifieeConst::cell__); }
    return m;
 }
 
+U32
+Tissue::cellsDelIf(CellPredicate _pred) {
+   // Survivors are packed down the dense index in place, carrying their
+   // infected bit and strengths; the rest are collected for removal.
+   CellVector deleted;
+   bool infectedDeleted = false;
+   U32 kept = 0;
+   for( U32 i=0;i<cellIndex_.size();++i) {
+      Cell * c = cellIndex_[i];
+      if(_pred(c)) {
+         deleted.push_back(c);
+         if(infectedSet_.bit(i)) infectedDeleted = true;
+         continue;
+      }
+      if(kept != i) {
+         cellIndex_[kept] = c;
+         c->index_ = kept;
+         infectedSet_.bitIs(kept, infectedSet_.bit(i));
+         for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+            strengthIndex_[s][kept] = strengthIndex_[s][i];
+         }
+      }
+      ++kept;
+   }
+   if(deleted.empty()) return 0;
+   for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+      std::fill(strengthIndex_[s].begin() + kept, strengthIndex_[s].end(), 0);
+   }
+   cellIndex_.resize(kept);
+   infectedSet_.sizeIs(kept);
+   if(infectedDeleted) infectedBoxStale_ = true;
+
+   for( U32 i=0;i<deleted.size();++i) {
+      Cell * c = deleted[i].ptr();
+      if(cellStorage_ == chunkedStorage_) cellGrid_.memberUnlink(c->location());
+      else if(cellStorage_ == shardedStorage_) cellShards_.memberUnlink(c->location());
+      else cell_.memberUnlink(c->location());
+      neighborsUnlink(c);
+      c->index_ = Cell::noIndex;
+      c->tissueIs(0);
+   }
+   if(cellStorage_ == chunkedStorage_) cellGrid_.bucketsFit();
+   else if(cellStorage_ == shardedStorage_) cellShards_.bucketsFit();
+   else cell_.bucketsFit();
+   if(notificationBatches_) {
+      cellsDelPending_.insert(cellsDelPending_.end(), deleted.begin(), deleted.end());
+      return deleted.size();
+   }
+   if(notificationDeferred_) {
+      cellsDelDeferred(deleted);
+      return deleted.size();
+   }
+
+   retrycellsDel:
+   U32 ver = notifiee_.version();
+   if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
+      n->onCellsDel(deleted);
+      if( ver != notifiee_.version() ) goto retrycellsDel;
+   } catch(...) { n->onNotificationException(NotifieeConst::cell__); }
+   return deleted.size();
+}
+
 Cell::Ptr
 Tissue::cellIs(Cell::Ptr cell) {
-  Fwk::String name = cell->location().name();
-  Cell::Ptr m = cell_[name];
-   if(m) {
-      throw Fwk::NameInUseException(name);
-   } else {
-     m = cell;
-     cell_.newMember(m);
+   {
+      ShardLock lock(this, cell->location());
+      if(cellMember(cell->location())) {
+         throw Fwk::NameInUseException(cell->name());
+      }
+      cellMemberNew(cell.ptr());
+      neighborsLink(cell.ptr());
+      IndexLock index(this);
+      cellIndexNew(cell.ptr());
+      if(notificationBatches_) {
+         cellsNewPending_.push_back(cell);
+         return cell;
+      }
+      if(notificationDeferred_) {
+         cellsNewDeferred(CellVector(1, cell));
+         return cell;
+      }
    }
    retrycell:
    U32 ver = notifiee_.version();
@@ -482,7 +717,368 @@ Tissue::cellIs(Cell::Ptr cell) {
    return cell;
 }
 
-Tissue::Tissue(Fwk::String _name): Fwk::NamedInterface(_name) {
+void
+Tissue::notificationBatchDel() {
+   if(!notificationBatches_ || --notificationBatches_) return;
+   // Take the queues first: a notifiee may change the tissue in turn.
+   CellVector added(cellsNewPending_.begin(), cellsNewPending_.end());
+   CellVector removed(cellsDelPending_.begin(), cellsDelPending_.end());
+   cellsNewPending_.clear();
+   cellsDelPending_.clear();
+   if(!added.empty() && !removed.empty()) {
+      // Additions and removals of one cell alternate, so the difference
+      // of their counts is its net change; report only that.
+      std::map<Cell *, S32> net;
+      for(U32 i = 0; i < added.size(); ++i) ++net[added[i].ptr()];
+      for(U32 i = 0; i < removed.size(); ++i) --net[removed[i].ptr()];
+      CellVector a, r;
+      for(U32 i = 0; i < added.size(); ++i) {
+         S32 & n = net[added[i].ptr()];
+         if(n > 0) a.push_back(added[i]);
+         n = 0;
+      }
+      for(U32 i = 0; i < removed.size(); ++i) {
+         S32 & n = net[removed[i].ptr()];
+         if(n < 0) r.push_back(removed[i]);
+         n = 0;
+      }
+      added.swap(a);
+      removed.swap(r);
+   }
+   if(notificationDeferred_) {
+      if(!added.empty()) cellsNewDeferred(added);
+      if(!removed.empty()) cellsDelDeferred(removed);
+      return;
+   }
+   if(!added.empty()) {
+      retrycellsNew:
+      U32 ver = notifiee_.version();
+      if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
+         n->onCellsNew(added);
+         if( ver != notifiee_.version() ) goto retrycellsNew;
+      } catch(...) { n->onNotificationException(NotifieeConst::cell__); }
+   }
+   if(!removed.empty()) {
+      retrycellsDel:
+      U32 ver = notifiee_.version();
+      if(notifiees()) for(NotifieeIterator n=notifieeIter();n.ptr();++n) try {
+         n->onCellsDel(removed);
+         if( ver != notifiee_.version() ) goto retrycellsDel;
+      } catch(...) { n->onNotificationException(NotifieeConst::cell__); }
+   }
+}
+
+void
+Tissue::notificationDeferredIs(bool _deferred) {
+   notificationDeferred_ = _deferred;
+   if(!_deferred) deferred_.dispatch();
+}
+
+void
+Tissue::cellsNewDeferred(CellVector const & _cells) {
+   for(NotifieeIterator n=notifieeIter();n.ptr();++n) {
+      n->cellsNewDeferred_.insert(n->cellsNewDeferred_.end(), _cells.begin(), _cells.end());
+      deferred_.notifieeNew(n.ptr(), NotifieeConst::cell__);
+   }
+}
+
+void
+Tissue::cellsDelDeferred(CellVector const & _cells) {
+   for(NotifieeIterator n=notifieeIter();n.ptr();++n) {
+      n->cellsDelDeferred_.insert(n->cellsDelDeferred_.end(), _cells.begin(), _cells.end());
+      deferred_.notifieeNew(n.ptr(), NotifieeConst::cell__);
+   }
+}
+
+void
+Tissue::cellsReserve(U32 _cells) {
+   cellIndex_.reserve(_cells);
+   if(cellStorage_ == chunkedStorage_) return;
+   if(cellStorage_ == shardedStorage_) {
+      U32 perShard = _cells / CellShards::shards;
+      if(perShard > 4 * cellShards_.shardMap(0).buckets()) cellShards_.bucketsIs(perShard / 2);
+      return;
+   }
+   // CellMap doubles past 4 members per bucket; leave room for 2 each.
+   if(_cells > 4 * cell_.buckets()) cell_.bucketsIs(_cells / 2);
+}
+
+static void
+snapshotWordWrite(std::vector<char> & _out, U32 _value) {
+   for( U32 i=0;i<4;++i) _out.push_back(char(_value >> (8 * i)));
+}
+
+static U32
+snapshotWord(char const * _p) {
+   U32 value = 0;
+   for( U32 i=0;i<4;++i) value |= U32(U8(_p[i])) << (8 * i);
+   return value;
+}
+
+void
+Tissue::snapshotWrite(std::vector<char> & _out) const {
+   _out.reserve(_out.size() + snapshotHeaderSize + cellIndex_.size() * snapshotCellSize);
+   _out.insert(_out.end(), snapshotMagic, snapshotMagic + sizeof(snapshotMagic));
+   snapshotWordWrite(_out, snapshotVersion);
+   snapshotWordWrite(_out, cellIndex_.size());
+   for( U32 i=0;i<cellIndex_.size();++i) {
+      Cell const * c = cellIndex_[i];
+      snapshotWordWrite(_out, U32(c->location_.x));
+      snapshotWordWrite(_out, U32(c->location_.y));
+      snapshotWordWrite(_out, U32(c->location_.z));
+      _out.push_back(char(c->cellType_));
+      _out.push_back(char(c->health_));
+      _out.push_back(char(c->membraneExists_));
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         _out.push_back(char(c->antibodyStrength_[s].value()));
+      }
+   }
+}
+
+void
+Tissue::snapshotRead(char const * _data, size_t _size) {
+   if(cells()) throw Fwk::NameInUseException(name());
+   if(_size < snapshotHeaderSize ||
+      memcmp(_data, snapshotMagic, sizeof(snapshotMagic)) != 0 ||
+      snapshotWord(_data + 4) != snapshotVersion) {
+      throw Fwk::RangeException("snapshot header");
+   }
+   U32 n = snapshotWord(_data + 8);
+   if(_size != snapshotHeaderSize + U64(n) * snapshotCellSize) {
+      throw Fwk::RangeException("snapshot size");
+   }
+   // Check every record first so that a corrupt snapshot adds nothing.
+   char const * cells = _data + snapshotHeaderSize;
+   std::vector<Cell::Coordinates> locs(n);
+   for( U32 i=0;i<n;++i) {
+      char const * p = cells + i * snapshotCellSize;
+      if(U8(p[12]) > Cell::otherCell_ || U8(p[13]) < Cell::healthy_ ||
+         U8(p[13]) > Cell::infected_ || U8(p[14]) >> 6) {
+         throw Fwk::RangeException("snapshot cell");
+      }
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         if(U8(p[15 + s]) > 100) throw Fwk::RangeException("snapshot strength");
+      }
+      locs[i].x = S32(snapshotWord(p));
+      locs[i].y = S32(snapshotWord(p + 4));
+      locs[i].z = S32(snapshotWord(p + 8));
+   }
+   std::sort(locs.begin(), locs.end());
+   std::vector<Cell::Coordinates>::iterator twin =
+      std::adjacent_find(locs.begin(), locs.end());
+   if(twin != locs.end()) throw Fwk::NameInUseException(twin->name());
+   cellsReserve(n);
+   for( char const * p=cells;p<cells + n * snapshotCellSize;p+=snapshotCellSize) {
+      Cell::Coordinates loc;
+      loc.x = S32(snapshotWord(p));
+      loc.y = S32(snapshotWord(p + 4));
+      loc.z = S32(snapshotWord(p + 8));
+      Cell::Ptr c = Cell::CellNew(loc, this, Cell::CellType(U8(p[12])));
+      c->health_ = Cell::HealthId(U8(p[13]));
+      c->membraneExists_ = U8(p[14]);
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         c->antibodyStrength_[s] = AntibodyStrength(U8(p[15 + s]));
+      }
+      cellMemberNew(c.ptr());
+      neighborsLink(c.ptr());
+      cellIndexNew(c.ptr());
+   }
+}
+
+void
+Tissue::cellsCopy(Tissue const * _parent) {
+   if(cells()) throw Fwk::NameInUseException(name());
+   U32 n = _parent->cellIndex_.size();
+   cellsReserve(n);
+   for( U32 i=0;i<n;++i) {
+      Cell const * p = _parent->cellIndex_[i];
+      Cell::Ptr c = Cell::CellNew(p->location_, this, p->cellType_);
+      c->health_ = p->health_;
+      c->membraneExists_ = p->membraneExists_;
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         c->antibodyStrength_[s] = p->antibodyStrength_[s];
+      }
+      c->index_ = i;
+      cellMemberNew(c.ptr());
+      cellIndex_.push_back(c.ptr());
+   }
+   for( U32 i=0;i<n;++i) {
+      Cell const * p = _parent->cellIndex_[i];
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         Cell const * nbr = p->neighbor_[s];
+         cellIndex_[i]->neighbor_[s] = nbr ? cellIndex_[nbr->index_] : 0;
+      }
+   }
+   infectedSet_ = _parent->infectedSet_;
+   infectedMin_ = _parent->infectedMin_;
+   infectedMax_ = _parent->infectedMax_;
+   infectedBoxStale_ = _parent->infectedBoxStale_;
+   for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+      strengthIndex_[s] = _parent->strengthIndex_[s];
+   }
+}
+
+Cell::Ptr
+Tissue::neighbor(Cell::Coordinates _loc, CellMembrane::Side _side) {
+   if(cellStorage_ == shardedStorage_) return cellLocked(_loc.shifted(_side));
+   return neighborMember(_loc, _side);
+}
+
+Cell *
+Tissue::neighborMember(Cell::Coordinates _loc, CellMembrane::Side _side) const {
+   if(cellStorage_ != chunkedStorage_) return cellMember(_loc.shifted(_side));
+   CellGrid & grid = const_cast<CellGrid &>(cellGrid_);
+   switch(_side) {
+      case CellMembrane::north_ : return grid.neighbor(_loc, 0, 1, 0);
+      case CellMembrane::south_ : return grid.neighbor(_loc, 0, -1, 0);
+      case CellMembrane::east_ : return grid.neighbor(_loc, 1, 0, 0);
+      case CellMembrane::west_ : return grid.neighbor(_loc, -1, 0, 0);
+      case CellMembrane::up_ : return grid.neighbor(_loc, 0, 0, 1);
+      case CellMembrane::down_ : return grid.neighbor(_loc, 0, 0, -1);
+   }
+   return 0;
+}
+
+Cell::Ptr
+Tissue::cellLocked(Cell::Coordinates _loc) const {
+   U32 s = CellShards::shard(_loc);
+   cellShards_.lock(s);
+   Cell::Ptr c = cellMember(_loc);
+   cellShards_.unlock(s);
+   return c;
+}
+
+void
+Tissue::cellMemberNew(Cell * _cell) {
+   if(cellStorage_ == chunkedStorage_) cellGrid_.newMember(_cell);
+   else if(cellStorage_ == shardedStorage_) cellShards_.newMember(_cell);
+   else cell_.newMember(_cell);
+}
+
+Cell::Ptr
+Tissue::cellMemberDel(Cell::Coordinates _loc) {
+   if(cellStorage_ == chunkedStorage_) return cellGrid_.deleteMember(_loc);
+   if(cellStorage_ == shardedStorage_) return cellShards_.deleteMember(_loc);
+   return cell_.deleteMember(_loc);
+}
+
+void
+Tissue::neighborsLink(Cell * _cell) {
+   // Lookups go straight to the storage: with shardedStorage the caller
+   // holds the shards of _cell and its neighbors, and no reference to a
+   // neighbor is taken, since its count belongs to another thread.
+   for( U32 i=CellMembrane::north_;i<=CellMembrane::down_;++i) {
+      CellMembrane::Side side = CellMembrane::Side(i);
+      Cell * n = neighborMember(_cell->location(), side);
+      _cell->neighbor_[side] = n;
+      if(n) n->neighbor_[CellMembrane::opposite(side)] = _cell;
+   }
+}
+
+void
+Tissue::neighborsUnlink(Cell * _cell) {
+   for( U32 i=CellMembrane::north_;i<=CellMembrane::down_;++i) {
+      CellMembrane::Side side = CellMembrane::Side(i);
+      Cell * n = _cell->neighbor_[side];
+      if(n) n->neighbor_[CellMembrane::opposite(side)] = 0;
+      _cell->neighbor_[side] = 0;
+   }
+}
+
+void
+Tissue::cellIndexNew(Cell * _cell) {
+   U32 i = cellIndex_.size();
+   cellIndex_.push_back(_cell);
+   infectedSet_.sizeIs(i + 1);
+   infectedIs(i, _cell->health() == Cell::infected());
+   for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+      strengthIndex_[s].resize((i + 64) & ~63u, 0);
+      strengthIndex_[s][i] = _cell->antibodyStrength(CellMembrane::Side(s)).value();
+   }
+   _cell->index_ = i;
+}
+
+void
+Tissue::cellIndexDel(Cell * _cell) {
+   U32 i = _cell->index_;
+   U32 last = cellIndex_.size() - 1;
+   infectedIs(i, false);
+   Cell * moved = cellIndex_[last];
+   cellIndex_[i] = moved;
+   moved->index_ = i;
+   infectedSet_.bitIs(i, infectedSet_.bit(last));
+   for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+      strengthIndex_[s][i] = strengthIndex_[s][last];
+      strengthIndex_[s][last] = 0;
+   }
+   cellIndex_.pop_back();
+   infectedSet_.sizeIs(last);
+   _cell->index_ = Cell::noIndex;
+}
+
+static void
+boxExtend(Cell::Coordinates & _min, Cell::Coordinates & _max, Cell::Coordinates _loc) {
+   if(_loc.x < _min.x) _min.x = _loc.x;
+   if(_loc.y < _min.y) _min.y = _loc.y;
+   if(_loc.z < _min.z) _min.z = _loc.z;
+   if(_loc.x > _max.x) _max.x = _loc.x;
+   if(_loc.y > _max.y) _max.y = _loc.y;
+   if(_loc.z > _max.z) _max.z = _loc.z;
+}
+
+void
+Tissue::infectedIs(U32 _index, bool _infected) {
+   if(infectedSet_.bit(_index) == _infected) return;
+   infectedSet_.bitIs(_index, _infected);
+   Cell::Coordinates loc = cellIndex_[_index]->location();
+   if(_infected) {
+      if(infectedSet_.members() == 1) {
+         infectedMin_ = infectedMax_ = loc;
+         infectedBoxStale_ = false;
+      } else if(!infectedBoxStale_) {
+         boxExtend(infectedMin_, infectedMax_, loc);
+      }
+   } else if(loc.x == infectedMin_.x || loc.y == infectedMin_.y ||
+             loc.z == infectedMin_.z || loc.x == infectedMax_.x ||
+             loc.y == infectedMax_.y || loc.z == infectedMax_.z) {
+      infectedBoxStale_ = true;
+   }
+}
+
+void
+Tissue::infectedBoxRescan() const {
+   infectedBoxStale_ = false;
+   bool first = true;
+   for( U32 w=0;w<infectedSet_.words();++w) {
+      for( U64 bits = infectedSet_.word(w); bits; bits &= bits - 1 ) {
+         Cell::Coordinates loc =
+            cellIndex_[(w << 6) + __builtin_ctzll(bits)]->location();
+         if(first) {
+            infectedMin_ = infectedMax_ = loc;
+            first = false;
+            continue;
+         }
+         boxExtend(infectedMin_, infectedMax_, loc);
+      }
+   }
+}
+
+U32
+Tissue::infectionVolume() const {
+   if(!infectedSet_.members()) return 0;
+   infectedBoxCheck();
+   return (infectedMax_.x - infectedMin_.x + 1) *
+          (infectedMax_.y - infectedMin_.y + 1) *
+          (infectedMax_.z - infectedMin_.z + 1);
+}
+
+Tissue::Tissue(Fwk::String _name, CellStorage _storage):
+      Fwk::NamedInterface(_name), cellStorage_(_storage),
+      allocator_(Fwk::SlabAllocator::SlabAllocatorNew()),
+      infectedBoxStale_(false), notificationBatches_(0),
+      notificationDeferred_(false) {
+   pthread_rwlock_init(&indexLock_, 0);
+   pthread_mutex_init(&infectedLock_, 0);
 
 }
 
@@ -4,12 +4,18 @@
 #ifndef TISSUE_H
 #define TISSUE_H
 
+#include <deque>
 #include "fwk/BaseNotifiee.h"
 #include "fwk/NamedInterface.h"
 #include "fwk/HashMap.h"
+#include "fwk/ChunkGrid.h"
+#include "fwk/ShardedMap.h"
+#include "fwk/SlabAllocator.h"
+#include "fwk/Bitset.h"
 #include "fwk/ListRaw.h"
 #include "fwk/LinkedList.h"
 #include "fwk/LinkedQueue.h"
+#include "fwk/NotificationQueue.h"
 #include "fwk/Array.h"
 #include "fwk/String.h"
 
@@ -40,7 +46,9 @@ protected:
 
 Fwk::Ostream & operator<<( Fwk::Ostream & s, AntibodyStrength const & val );
 
-class CellMembrane : public Fwk::NamedInterface {
+class Cell;
+
+class CellMembrane : public Fwk::NamedInterface, public Fwk::SlabAllocated {
 public:
    typedef Fwk::Ptr<CellMembrane const> PtrConst;
    typedef Fwk::Ptr<CellMembrane> Ptr;
@@ -62,10 +70,16 @@ public:
 
    static Side SideInstance( U32 v );
    static Side SideInstance( Fwk::String );
+   static inline Side opposite( Side _side ) { return Side( _side ^ 1 ); }
+   // Sides are declared in opposing pairs, so flipping the low bit maps
+   // north to south, east to west and up to down.
    Side side() const { return side_; }
 
-   const AntibodyStrength antibodyStrength() const { return antibodyStrength_; }
+   const AntibodyStrength antibodyStrength() const;
    void antibodyStrengthIs(AntibodyStrength _antibodyStrength);
+   Cell const * cell() const { return cell_; }
+   // Cell whose inline strength this membrane reads and writes, or null for
+   // a standalone membrane.
 
    class NotifieeConst : public virtual Fwk::NamedInterface::NotifieeConst {
    public:
@@ -124,8 +138,9 @@ public:
    U32 notifiees() const { return notifiee_.members(); }
    // Non-const interface =============================================
     ~CellMembrane();
-   static CellMembrane::Ptr CellMembraneNew(Fwk::String _name,Side _side) {
-      Ptr m = new CellMembrane(_name,_side);
+   static CellMembrane::Ptr CellMembraneNew(Fwk::String _name,Side _side,
+                                            Fwk::SlabAllocator * _allocator = 0) {
+      Ptr m = new (_allocator) CellMembrane(_name,_side);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -138,6 +153,9 @@ protected:
    Side side_;
    void sideIs(Side _side);
    AntibodyStrength antibodyStrength_;
+   Cell * cell_;
+   friend class Cell;
+   void cellIs(Cell * _cell);
    CellMembrane(Fwk::String _name, Side _side);
    void newNotifiee( CellMembrane::NotifieeConst * n ) const {
       CellMembrane* me = const_cast<CellMembrane*>(this);
@@ -153,7 +171,7 @@ protected:
 
 class Tissue;
 
-class Cell : public Fwk::NamedInterface {
+class Cell : public Fwk::NamedInterface, public Fwk::SlabAllocated {
 public:
    typedef Fwk::Ptr<Cell const> PtrConst;
    typedef Fwk::Ptr<Cell> Ptr;
@@ -161,12 +179,45 @@ public:
    struct Coordinates {
       int x, y, z;
       Fwk::String name() const;
+      static Coordinates CoordinatesInstance( Fwk::String );
       bool operator==(const Coordinates& other) const
       { return x == other.x && y == other.y && z == other.z; }
       bool operator!=(const Coordinates& other) const
       { return x != other.x || y != other.y || z != other.z; }
+      Coordinates shifted(CellMembrane::Side _side) const {
+         Coordinates loc = *this;
+         switch( _side ) {
+            case CellMembrane::north_ : ++loc.y; break;
+            case CellMembrane::south_ : --loc.y; break;
+            case CellMembrane::east_ : ++loc.x; break;
+            case CellMembrane::west_ : --loc.x; break;
+            case CellMembrane::up_ : ++loc.z; break;
+            case CellMembrane::down_ : --loc.z; break;
+         }
+         return loc;
+      }
+      // Location of the adjacent cell on _side.
+      bool operator<(const Coordinates& other) const {
+         if( x != other.x ) return x < other.x;
+         if( y != other.y ) return y < other.y;
+         return z < other.z;
+      }
+      // Integer hash used by Tissue::CellMap.  Mixes all three components
+      // so that neighboring cells land in unrelated buckets; no string is
+      // built for a lookup.
+      U32 hash() const {
+         U64 h = U64(U32(x)) * 0x9E3779B97F4A7C15ULL;
+         h ^= U64(U32(y)) * 0xC2B2AE3D27D4EB4FULL;
+         h ^= U64(U32(z)) * 0x165667B19E3779F9ULL;
+         h ^= h >> 29;
+         h *= 0xBF58476D1CE4E5B9ULL;
+         h ^= h >> 32;
+         return U32(h);
+      }
    };
    Coordinates location() const { return location_; }
+   Fwk::String name() const { return location_.name(); }
+   // Built from the location when asked for; cells keep no name string.
 
    enum CellType {
       tCell_ = 0,
@@ -191,23 +242,54 @@ public:
    static HealthId HealthIdInstance( Fwk::String );
    HealthId health() const { return health_; }
    void healthIs(HealthId _health);
+   // Membranes are stored inline as one antibody strength per side.  A
+   // CellMembrane object is only built the first time one is asked for,
+   // and from then on reads and writes the cell's inline strength.
+   AntibodyStrength antibodyStrength(CellMembrane::Side _side) const {
+      return antibodyStrength_[_side];
+   }
+   void antibodyStrengthIs(CellMembrane::Side _side, AntibodyStrength _strength);
+   bool membraneExists(CellMembrane::Side _side) const {
+      return membraneExists_ & (1 << _side);
+   }
    CellMembrane::PtrConst membrane(CellMembrane::Side _side) const {
-      return membrane_[_side];
+      return membraneMaterialized(_side);
    }
    CellMembrane::Ptr membrane(CellMembrane::Side _side) {
-      return membrane_[_side];
+      return membraneMaterialized(_side);
    }
    typedef Fwk::ArrayIteratorConst< CellMembrane::Ptr,CellMembrane::Side > MembraneIteratorConst;
    MembraneIteratorConst membraneIterConst() const {
+      membranesMaterialized();
       return MembraneIteratorConst( membrane_ ); }
    MembraneIteratorConst membraneIterConst(CellMembrane::Side _start) const {
+      membranesMaterialized();
       return MembraneIteratorConst( membrane_, _start ); }
-   U32 membranes() const {
-      MembraneIteratorConst i=membraneIterConst();
-      U32 result = 0;
-      while( i ) { ++result; ++i; }
-      return result;
+   U32 membranes() const { return __builtin_popcount( membraneExists_ ); }
+   Cell const * neighbor(CellMembrane::Side _side) const { return neighbor_[_side]; }
+   Cell * neighbor(CellMembrane::Side _side) { return neighbor_[_side]; }
+   // Adjacent cell in the same tissue, kept up to date by Tissue::cellIs
+   // and Tissue::cellDel.  Not a reference; null once the cell is removed.
+   U32 index() const { return index_; }
+   // Position in the tissue's dense cell index, or noIndex when the cell
+   // is not in a tissue.
+   static const U32 noIndex = 0xffffffff;
+   U64 infectionClaim() const {
+      return __atomic_load_n( &infectionClaim_, __ATOMIC_RELAXED );
    }
+   void infectionClaimIs(U64 _claim) {
+      U64 base = _claim & ~U64(0xffffffff);
+      U64 cur = __atomic_load_n( &infectionClaim_, __ATOMIC_RELAXED );
+      // A failed exchange reloads cur.
+      while( cur < base || cur > _claim ) {
+         if( __atomic_compare_exchange_n( &infectionClaim_, &cur, _claim, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) break;
+      }
+   }
+   // Scratch for parallel infection rounds.  A claim is a round stamp in
+   // the high word and an attack index in the low word; infectionClaimIs
+   // atomically keeps the lowest index claimed in the current round and
+   // may be called from several threads at once.
 
    class NotifieeConst : public virtual Fwk::NamedInterface::NotifieeConst {
    public:
@@ -236,6 +318,9 @@ public:
          tacMembraneChanges_ = _tacMembraneChanges;
       }
       virtual void onTissue() {}
+      virtual void onNotification();
+      // Delivers the membrane and tissue changes deferred since the last
+      // dispatch, once each.
       void lrNextIs(NotifieeConst * _lrNext) {
          lrNext_ = _lrNext;
       }
@@ -247,16 +332,21 @@ public:
       }
       // Constructors ====================================================
    protected:
+      friend class Cell;
       Cell::PtrConst notifier_;
 
       bool isNonReferencing_;
       CellMembrane::Side tacKeyForMembrane_;
       U8 tacMembraneChanges_;
+      U8 membranesDeferred_;
+      bool tissueDeferred_;
       NotifieeConst * lrNext_;
       NotifieeConst(): Fwk::NamedInterface::NotifieeConst(),
             isNonReferencing_(false),
             tacKeyForMembrane_(CellMembrane::north_),
             tacMembraneChanges_(0),
+            membranesDeferred_(0),
+            tissueDeferred_(false),
             lrNext_(0) { }
    };
    class Notifiee : public virtual NotifieeConst, public virtual Fwk::NamedInterface::Notifiee {
@@ -278,7 +368,7 @@ public:
    };
    Tissue const * tissue() const { return tissue_; }
    Tissue * tissue() { return tissue_; }
-   Fwk::String fwkKey() const { return name(); }
+   Coordinates fwkKey() const { return location_; }
    Cell const * fwkHmNext() const { return fwkHmNext_.ptr(); }
    Cell * fwkHmNext() { return fwkHmNext_.ptr(); }
    Cell const * fwkPtr() const { return this; }
@@ -294,16 +384,21 @@ public:
     ~Cell();
    typedef Fwk::ArrayIterator< CellMembrane::Ptr,CellMembrane::Side > MembraneIterator;
    MembraneIterator membraneIter() {
+      membranesMaterialized();
       return MembraneIterator( membrane_ ); }
    MembraneIterator membraneIter(CellMembrane::Side _start) {
+      membranesMaterialized();
       return MembraneIterator( membrane_, _start ); }
    CellMembrane::Ptr membraneDel(CellMembrane::Side _side);
-   CellMembrane::Ptr membraneNew(Fwk::String _name,CellMembrane::Side _side);
+   void membraneNew(CellMembrane::Side _side, AntibodyStrength _strength);
+   // Adds the membrane on _side without building a CellMembrane for it.
    void fwkHmNextIs(Cell * _fwkHmNext) const {
       fwkHmNext_ = _fwkHmNext;
    }
+   static Fwk::SlabAllocator * allocatorFor(Tissue * _tissue);
+   // Allocator for cells and membranes of _tissue; null for the heap.
    static Cell::Ptr CellNew(Cell::Coordinates _loc, Tissue * _tissue, CellType _type) {
-     Ptr m = new Cell(_loc, _tissue, _type);
+     Ptr m = new (allocatorFor(_tissue)) Cell(_loc, _tissue, _type);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -316,14 +411,24 @@ protected:
    // Undefined copy constructor to preclude copy.
    Coordinates location_;
    HealthId health_;
-   CellMembrane::Ptr newMembrane( Fwk::String _name, CellMembrane::Side _side );
-   Fwk::Array<CellMembrane::Ptr,6, CellMembrane::Side> membrane_;
+   AntibodyStrength antibodyStrength_[6];
+   U8 membraneExists_;
+   CellMembrane * membraneMaterialized(CellMembrane::Side _side) const;
+   void membranesMaterialized() const;
+   mutable Fwk::Array<CellMembrane::Ptr,6, CellMembrane::Side> membrane_;
    Tissue* tissue_;
    CellType cellType_;
+   Cell * neighbor_[6];
+   U32 index_;
+   U64 infectionClaim_;
 
    mutable Cell::Ptr fwkHmNext_;
    friend class Tissue;
    void tissueIs(Tissue * _tissue);
+   bool notificationDeferred() const;
+   void notificationDeferredNew(NotifieeConst::AttributeId _aid, U8 _membranes,
+                                Tissue * _tissue);
+   // Queues the notifiees on _tissue, which is in deferred mode.
    Cell(Coordinates _loc, Tissue * _tissue, CellType _type);
    void newNotifiee( Cell::NotifieeConst * n ) const {
       Cell* me = const_cast<Cell*>(this);
@@ -337,29 +442,137 @@ protected:
    void onZeroReferences();
 };
 
+Fwk::String valueToStrep( Cell::Coordinates const & loc );
+
+/*
+  Tissue snapshot format: snapshotMagic, a version word and the number of
+  cells, then per cell the x, y and z words, the type, health and membrane
+  mask bytes and the six membrane strengths, north to down.  Words are
+  32-bit little-endian.
+*/
+static const char snapshotMagic[4] = {'H', 'I', 'V', 'T'};
+static const U32 snapshotVersion = 1;
+static const U32 snapshotHeaderSize = 12;
+static const U32 snapshotCellSize = 21;
+
 class Tissue : public Fwk::NamedInterface {
 public:
    typedef Fwk::Ptr<Tissue const> PtrConst;
    typedef Fwk::Ptr<Tissue> Ptr;
+
+   enum CellStorage {
+      hashedStorage_ = 0,
+      chunkedStorage_ = 1,
+      shardedStorage_ = 2
+   };
+   static inline CellStorage hashedStorage() { return hashedStorage_; }
+   static inline CellStorage chunkedStorage() { return chunkedStorage_; }
+   static inline CellStorage shardedStorage() { return shardedStorage_; }
+   static CellStorage CellStorageInstance( Fwk::String );
+   CellStorage cellStorage() const { return cellStorage_; }
+   // hashedStorage keeps cells in a CellMap.  chunkedStorage keeps them in
+   // a CellGrid of 16x16x16 chunks, which suits compact tissues and makes
+   // neighbor lookups a slot offset.  shardedStorage keeps them in
+   // CellShards, a CellMap and a lock per shard of space, so that several
+   // threads may change the tissue at once; see cellIs.  Fixed when the
+   // tissue is created.
+
    Cell::PtrConst cell(Cell::Coordinates _loc) const {
-      return cell_[_loc.name()];
+      if( cellStorage_ == shardedStorage_ ) return cellLocked(_loc);
+      return cellMember(_loc);
    }
    Cell::Ptr cell(Cell::Coordinates _loc) {
-      return cell_[_loc.name()];
+      if( cellStorage_ == shardedStorage_ ) return cellLocked(_loc);
+      return cellMember(_loc);
    }
-   typedef Fwk::HashMap< Cell, Fwk::String, Cell, Cell::PtrConst, Cell::Ptr > CellMap;
+   Cell::Ptr neighbor(Cell::Coordinates _loc, CellMembrane::Side _side);
+   // Cell adjacent to _loc on _side, if any.
+   typedef Fwk::HashMap< Cell, Cell::Coordinates, Cell, Cell::PtrConst, Cell::Ptr > CellMap;
+   typedef Fwk::ChunkGrid< Cell, Cell::Coordinates, Cell, Cell::PtrConst, Cell::Ptr > CellGrid;
+   typedef Fwk::ShardedMap< Cell, Cell::Coordinates, Cell, Cell::PtrConst, Cell::Ptr > CellShards;
+   typedef std::vector<Cell::Ptr> CellVector;
+   typedef bool (*CellPredicate)(Cell const *);
 
+   U32 cells() const {
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.members();
+      return cellStorage_ == chunkedStorage_ ? cellGrid_.members() : cell_.members();
+   }
+   U32 cellVersion() const {
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.version();
+      return cellStorage_ == chunkedStorage_ ? cellGrid_.version() : cell_.version();
+   }
+   Cell * cellIndexed(U32 _index) const { return cellIndex_[_index]; }
+   // Cells are numbered densely from 0 to cells()-1 by Cell::index().
+   // Deleting a cell moves the highest numbered cell into its slot.
+   Fwk::Bitset const & infectedSet() const { return infectedSet_; }
+   U32 infectedCells() const { return infectedSet_.members(); }
+   // Infected cells by index, maintained by Cell::healthIs.
+   Cell::Coordinates infectedMin() const { infectedBoxCheck(); return infectedMin_; }
+   Cell::Coordinates infectedMax() const { infectedBoxCheck(); return infectedMax_; }
+   U32 infectionVolume() const;
+   // Bounding box of the infected cells and its volume, 0 if none.  The
+   // box grows as cells are infected; it is only rescanned after an
+   // infected cell on its boundary is healed or deleted.
+   U8 const * antibodyStrengths(CellMembrane::Side _side) const {
+      return strengthIndex_[_side].empty() ? 0 : &strengthIndex_[_side][0];
+   }
+   // Antibody strength of every cell's membrane on _side, by cell index.
+   // The array is padded with zeros to a multiple of 64 cells so that it
+   // can be scanned a bitset word at a time.
+   Fwk::SlabAllocator::PtrConst allocator() const { return allocator_; }
+   Fwk::SlabAllocator::Ptr allocator() { return allocator_; }
+   // Slab allocator for this tissue's cells and membranes; its live(),
+   // slabs() and bytes() report usage.
 
-   U32 cells() const { return cell_.members(); }
-   U32 cellVersion() const { return cell_.version(); }
-   typedef CellMap::IteratorConst CellIteratorConst;
-   CellIteratorConst cellIterConst() const { return cell_.iterator(); }
+   // Iterators work over either storage by advancing through the
+   // collection's generic StrepIterator interface.
+   class CellIteratorConst : public Fwk::BaseCollection::StrepIterator {
+   public:
+      CellIteratorConst() {}
+      CellIteratorConst( Fwk::BaseCollection::StrepIterator const & i ) :
+            Fwk::BaseCollection::StrepIterator( i ) {}
+      Cell const * ptr() const { return static_cast<Cell const *>( space_ ); }
+      Cell const * operator->() const { return ptr(); }
+      Cell::PtrConst operator*() const { return ptr(); }
+      operator int BoolConversion::*() const {
+         return space_ ? &BoolConversion::x : 0;
+      }
+      CellIteratorConst & operator++() {
+         Fwk::BaseCollection::StrepIterator::operator++();
+         return *this;
+      }
+   };
+   CellIteratorConst cellIterConst() const {
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.iterator();
+      if( cellStorage_ == chunkedStorage_ ) return cellGrid_.iterator();
+      return cell_.iterator();
+   }
    CellIteratorConst cellIterConst( Cell::Coordinates _loc ) const {
-      return cell_.iterator( _loc.name() ); }
-   typedef CellMap::Iterator CellIterator;
-   CellIterator cellIter() { return cell_.iterator(); }
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.iterator( _loc );
+      if( cellStorage_ == chunkedStorage_ ) return cellGrid_.iterator( _loc );
+      return cell_.iterator( _loc ); }
+   class CellIterator : public CellIteratorConst {
+   public:
+      CellIterator() {}
+      CellIterator( Fwk::BaseCollection::StrepIterator const & i ) :
+            CellIteratorConst( i ) {}
+      Cell * ptr() const { return const_cast<Cell *>( CellIteratorConst::ptr() ); }
+      Cell * operator->() const { return ptr(); }
+      Cell::Ptr operator*() const { return ptr(); }
+      CellIterator & operator++() {
+         CellIteratorConst::operator++();
+         return *this;
+      }
+   };
+   CellIterator cellIter() {
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.iterator();
+      if( cellStorage_ == chunkedStorage_ ) return cellGrid_.iterator();
+      return cell_.iterator();
+   }
    CellIterator cellIter( Cell::Coordinates _loc ) {
-      return cell_.iterator( _loc.name() ); }
+      if( cellStorage_ == shardedStorage_ ) return cellShards_.iterator( _loc );
+      if( cellStorage_ == chunkedStorage_ ) return cellGrid_.iterator( _loc );
+      return cell_.iterator( _loc ); }
 
 
    class NotifieeConst : public virtual Fwk::NamedInterface::NotifieeConst {
@@ -371,7 +584,7 @@ public:
       bool isNonReferencing() const { return isNonReferencing_; }
       static const AttributeId cell__ = AttributeId(Fwk::NamedInterface::NotifieeConst::tacNextAttributeId__);
       static const AttributeId tacNextAttributeId__ = AttributeId(cell__+1);
-      Fwk::String tacKeyForCell() const { return tacKeyForCell_; }
+      Cell::Coordinates tacKeyForCell() const { return tacKeyForCell_; }
       U8 tacCellChanges() const { return tacCellChanges_; }
       NotifieeConst const * lrNext() const { return lrNext_; }
       NotifieeConst * lrNext() { return lrNext_; }
@@ -382,10 +595,26 @@ public:
       virtual void onCellNew( Cell::Ptr ) {}
       virtual void onCellDel( Fwk::String _name ) {}
       virtual void onCellDel( Cell::Ptr ) {}
+      virtual void onCellsNew( CellVector const & _cells ) {
+         for( U32 i = 0; i < _cells.size(); ++i ) onCellNew( _cells[i] );
+      }
+      // Cells added while a notification batch was open.
+      virtual void onCellsDel( CellVector const & _cells ) {
+         for( U32 i = 0; i < _cells.size(); ++i ) {
+            onCellDel( _cells[i]->name() );
+            onCellDel( _cells[i] );
+         }
+      }
+      // Cells removed by cellsDelIf or while a notification batch was open.
+      // The defaults report each cell as cellIs and cellDel would; override
+      // to handle the batch as a whole.
+      virtual void onNotification();
+      // Delivers the cell additions and removals deferred since the last
+      // dispatch as one onCellsNew and one onCellsDel.
 
 
       void onCell() {}
-      void tacKeyForCellIs(Fwk::String _tacKeyForCell) {
+      void tacKeyForCellIs(Cell::Coordinates _tacKeyForCell) {
          tacKeyForCell_ = _tacKeyForCell;
       }
       void tacCellChangesIs(U8 _tacCellChanges) {
@@ -402,10 +631,13 @@ public:
       }
       // Constructors ====================================================
    protected:
+      friend class Tissue;
       Tissue::PtrConst notifier_;
       bool isNonReferencing_;
-      Fwk::String tacKeyForCell_;
+      Cell::Coordinates tacKeyForCell_;
       U8 tacCellChanges_;
+      CellVector cellsNewDeferred_;
+      CellVector cellsDelDeferred_;
       NotifieeConst * lrNext_;
       NotifieeConst(): Fwk::NamedInterface::NotifieeConst(),
             isNonReferencing_(false),
@@ -437,10 +669,72 @@ public:
    U32 notifiees() const { return notifiee_.members(); }
    // Non-const interface =============================================
     ~Tissue();
+   Cell::Ptr cellDel(Cell::Coordinates _loc);
    Cell::Ptr cellDel(Fwk::String _name);
+   // Compatibility form; parses a "(x,y,z)" cell name.  Returns 0 for a
+   // name that is not one, as for a cell that is not there.
+   U32 cellsDelIf(CellPredicate _pred);
+   // Removes every cell for which _pred holds in one sweep, resizing the
+   // cell map at most once, and reports them in a single onCellsDel.
+   // Returns the number removed.
    Cell::Ptr cellIs(Cell::Ptr cell);
-   static Tissue::Ptr TissueNew(Fwk::String _name) {
-      Ptr m = new Tissue(_name);
+   // With shardedStorage, cellIs, cellDel, cell, neighbor and the
+   // Cell::healthIs and Cell::antibodyStrengthIs of cells in the tissue
+   // may be called from several threads at once: each takes the locks of
+   // the shards it looks at and a lock on the dense index, shared by
+   // healthIs and antibodyStrengthIs, which only change their own cell's
+   // entries, and exclusive for cellIs and cellDel, which move them.  Threads
+   // must still work on different cells, since a cell's own state is not
+   // locked, nor is its reference count unless the build defines
+   // FWK_ATOMIC_REFERENCES; keeping to different regions of space does
+   // that.  Notifications are not locked either, so concurrent
+   // callers open a NotificationBatch first, or leave the tissue without
+   // notifiees.  Iteration, cellsDelIf, snapshotRead and cellsCopy are
+   // for one thread only.
+   void cellsReserve(U32 _cells);
+   // Sizes the cell map for _cells members so that a batch of cellIs
+   // calls does not grow it step by step.
+   void snapshotWrite(std::vector<char> & _out) const;
+   void snapshotRead(char const * _data, size_t _size);
+   // A snapshot holds every cell in index order: its location, type,
+   // health, membranes and their strengths.  snapshotRead rebuilds the
+   // cells of a snapshot in this tissue, which must be empty, without
+   // notifying anyone; it throws RangeException if the snapshot is corrupt
+   // and NameInUseException if it repeats a location, having added no
+   // cells.
+   void cellsCopy(Tissue const * _parent);
+   // Copies every cell of _parent into this tissue, which must be empty,
+   // without notifying anyone.  Cells keep their index, so the neighbor
+   // links, dense index and infected set are copied rather than rebuilt.
+   U32 notificationBatches() const { return notificationBatches_; }
+   void notificationBatchNew() { ++notificationBatches_; }
+   void notificationBatchDel();
+   // While a batch is open, cellIs, cellDel and cellsDelIf queue their
+   // notifications; closing the outermost batch delivers all additions in
+   // one onCellsNew and then all removals in one onCellsDel.  A cell both
+   // added and removed in the batch is reported for its net change only,
+   // so one added and removed again is not reported at all.
+   bool notificationDeferred() const { return notificationDeferred_; }
+   void notificationDeferredIs(bool _deferred);
+   void notificationsDispatch() { deferred_.dispatch(); }
+   // In deferred mode, changes to the tissue and its cells are recorded in
+   // each affected notifiee, which is queued once until
+   // notificationsDispatch delivers everything it has missed.  Leaving
+   // deferred mode dispatches.
+   class NotificationBatch {
+    public:
+      NotificationBatch( Tissue * _tissue ) : tissue_(_tissue) {
+         tissue_->notificationBatchNew();
+      }
+      ~NotificationBatch() { tissue_->notificationBatchDel(); }
+    private:
+      NotificationBatch( const NotificationBatch& );
+      Tissue::Ptr tissue_;
+   };
+   // Scoped notification batch.
+   static Tissue::Ptr TissueNew(Fwk::String _name,
+                                CellStorage _storage = hashedStorage_) {
+      Ptr m = new Tissue(_name, _storage);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -451,8 +745,104 @@ public:
 protected:
    Tissue( const Tissue& );
    // Cell::Ptr newCell( Cell::Coordinates _loc );
+   Cell * cellMember( Cell::Coordinates _loc ) const {
+      if( cellStorage_ == chunkedStorage_ ) {
+         return const_cast<CellGrid &>( cellGrid_ )[_loc];
+      }
+      if( cellStorage_ == shardedStorage_ ) {
+         return const_cast<CellShards &>( cellShards_ )[_loc];
+      }
+      return const_cast<CellMap &>( cell_ )[_loc];
+   }
+   // Lookup alone; with shardedStorage the caller holds the shard lock.
+   Cell * neighborMember( Cell::Coordinates _loc, CellMembrane::Side _side ) const;
+   Cell::Ptr cellLocked( Cell::Coordinates _loc ) const;
+   void cellMemberNew( Cell * _cell );
+   Cell::Ptr cellMemberDel( Cell::Coordinates _loc );
+   CellStorage cellStorage_;
+   Fwk::SlabAllocator::Ptr allocator_;
+   std::vector<Cell *> cellIndex_;
+   Fwk::Bitset infectedSet_;
+   mutable Cell::Coordinates infectedMin_;
+   mutable Cell::Coordinates infectedMax_;
+   mutable bool infectedBoxStale_;
+   U32 notificationBatches_;
+   std::deque<Cell::Ptr> cellsNewPending_;
+   std::deque<Cell::Ptr> cellsDelPending_;
+   // Deques, so that queuing a cell never copies the others: with
+   // shardedStorage their reference counts belong to other threads.
+   bool notificationDeferred_;
+   Fwk::NotificationQueue deferred_;
+   void cellsNewDeferred(CellVector const & _cells);
+   void cellsDelDeferred(CellVector const & _cells);
+   void infectedIs(U32 _index, bool _infected);
+   void infectedBoxCheck() const {
+      if( infectedBoxStale_ ) infectedBoxRescan();
+   }
+   void infectedBoxRescan() const;
+   std::vector<U8> strengthIndex_[6];
+   friend class Cell;
+   void cellIndexNew(Cell * _cell);
+   void cellIndexDel(Cell * _cell);
    CellMap   cell_;
-   explicit Tissue(Fwk::String _name);
+   CellGrid  cellGrid_;
+   CellShards cellShards_;
+   mutable pthread_rwlock_t indexLock_;
+   mutable pthread_mutex_t infectedLock_;
+   // With shardedStorage only.  indexLock_ is held shared while a cell
+   // changes its own entry in the strength arrays or infected set, and
+   // exclusively while the dense index or notification queues change,
+   // since cellIndexDel moves another cell's entries.  infectedLock_ is
+   // taken inside a shared hold for the infected set's count, its words,
+   // which neighbouring indices share, and the infected box.
+   void indexLock() const {
+      if( cellStorage_ == shardedStorage_ ) pthread_rwlock_wrlock( &indexLock_ );
+   }
+   void indexShare() const {
+      if( cellStorage_ == shardedStorage_ ) pthread_rwlock_rdlock( &indexLock_ );
+   }
+   void indexUnlock() const {
+      if( cellStorage_ == shardedStorage_ ) pthread_rwlock_unlock( &indexLock_ );
+   }
+   void infectedLock() const {
+      if( cellStorage_ == shardedStorage_ ) pthread_mutex_lock( &infectedLock_ );
+   }
+   void infectedUnlock() const {
+      if( cellStorage_ == shardedStorage_ ) pthread_mutex_unlock( &infectedLock_ );
+   }
+   class ShardLock {
+    public:
+      ShardLock( Tissue const * _tissue, Cell::Coordinates _loc ) :
+            tissue_(_tissue), loc_(_loc) {
+         if( tissue_->cellStorage_ == shardedStorage_ ) {
+            tissue_->cellShards_.neighborhoodLock( loc_ );
+         }
+      }
+      ~ShardLock() {
+         if( tissue_->cellStorage_ == shardedStorage_ ) {
+            tissue_->cellShards_.neighborhoodUnlock( loc_ );
+         }
+      }
+    private:
+      ShardLock( const ShardLock& );
+      Tissue const * tissue_;
+      Cell::Coordinates loc_;
+   };
+   // Shards a change at a location looks at, held for its scope.
+   class IndexLock {
+    public:
+      IndexLock( Tissue const * _tissue, bool _shared = false ) :
+            tissue_(_tissue) {
+         if( _shared ) tissue_->indexShare();
+         else tissue_->indexLock();
+      }
+      ~IndexLock() { tissue_->indexUnlock(); }
+    private:
+      IndexLock( const IndexLock& );
+      Tissue const * tissue_;
+   };
+   // The dense index, held for its scope; shared for a cell's own entries.
+   Tissue(Fwk::String _name, CellStorage _storage);
    void newNotifiee( Tissue::NotifieeConst * n ) const {
       Tissue* me = const_cast<Tissue*>(this);
       me->notifiee_.newMember(n);
@@ -463,6 +853,8 @@ protected:
    }
    NotifieeList notifiee_;
    void onZeroReferences();
+   void neighborsLink(Cell * _cell);
+   void neighborsUnlink(Cell * _cell);
 };
 
 
@@ -513,11 +905,11 @@ public:
    protected:
       Notifiee(): Cell::Notifiee() {}
    };
-   Fwk::String fwkKey() const { return name(); }
+   Coordinates fwkKey() const { return location_; }
    virtual Fwk::String attributeString( Fwk::RootNotifiee::AttributeId ) const;
    // Non-const interface =============================================
    static TCell::Ptr TCellIs(Coordinates _loc, Tissue * _tissue, Cell::CellType _type) {
-      Ptr m = new TCell(_loc,_tissue, _type);
+      Ptr m = new (allocatorFor(_tissue)) TCell(_loc,_tissue, _type);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -576,11 +968,11 @@ public:
    protected:
       Notifiee(): TCell::Notifiee() {}
    };
-   Fwk::String fwkKey() const { return name(); }
+   Coordinates fwkKey() const { return location_; }
    virtual Fwk::String attributeString( Fwk::RootNotifiee::AttributeId ) const;
    // Non-const interface =============================================
    static CytotoxicCell::Ptr CytotoxicCellIs(Coordinates _loc, Tissue * _tissue) {
-      Ptr m = new CytotoxicCell(_loc,_tissue);
+      Ptr m = new (allocatorFor(_tissue)) CytotoxicCell(_loc,_tissue);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -640,11 +1032,11 @@ public:
    protected:
       Notifiee(): TCell::Notifiee() {}
    };
-   Fwk::String fwkKey() const { return name(); }
+   Coordinates fwkKey() const { return location_; }
    virtual Fwk::String attributeString( Fwk::RootNotifiee::AttributeId ) const;
    // Non-const interface =============================================
    static HelperCell::Ptr HelperCellIs(Coordinates _loc, Tissue * _tissue) {
-     Ptr m = new HelperCell(_loc, _tissue);
+     Ptr m = new (allocatorFor(_tissue)) HelperCell(_loc, _tissue);
       m->referencesDec(1);
       // decr. refer count to compensate for initial val of 1
       return m;
@@ -0,0 +1,332 @@
+// TissueImage.cpp
+
+#include <algorithm>
+#include <string.h>
+#include "TissueImage.h"
+
+//----------| Morton keys |------------//
+
+// Spreads the low 21 bits of _v three bits apart.
+static U64
+mortonSpread(U32 _v) {
+   U64 x = _v & 0x1fffff;
+   x = (x | x << 32) & 0x1f00000000ffffULL;
+   x = (x | x << 16) & 0x1f0000ff0000ffULL;
+   x = (x | x << 8) & 0x100f00f00f00f00fULL;
+   x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+   x = (x | x << 2) & 0x1249249249249249ULL;
+   return x;
+}
+
+static U32
+mortonCompact(U64 _x) {
+   U64 x = _x & 0x1249249249249249ULL;
+   x = (x ^ x >> 2) & 0x10c30c30c30c30c3ULL;
+   x = (x ^ x >> 4) & 0x100f00f00f00f00fULL;
+   x = (x ^ x >> 8) & 0x1f0000ff0000ffULL;
+   x = (x ^ x >> 16) & 0x1f00000000ffffULL;
+   x = (x ^ x >> 32) & 0x1fffff;
+   return U32(x);
+}
+
+static bool
+imageCoordinate(S32 _v) {
+   return _v >= -imageCoordinateBias && _v < imageCoordinateBias;
+}
+
+static U64
+mortonKey(Cell::Coordinates _loc) {
+   return mortonSpread(U32(_loc.x + imageCoordinateBias)) |
+          mortonSpread(U32(_loc.y + imageCoordinateBias)) << 1 |
+          mortonSpread(U32(_loc.z + imageCoordinateBias)) << 2;
+}
+
+//----------| TissueImage Implementation |------------//
+
+void
+TissueImage::imageWrite(Tissue const * _tissue, U32 _cytotoxicCells,
+                        U32 _helperCells, std::vector<char> & _out) {
+   U32 n = _tissue->cells();
+   std::vector< std::pair<U64, U32> > order(n);
+   for( U32 i=0;i<n;++i) {
+      Cell::Coordinates loc = _tissue->cellIndexed(i)->location();
+      if(!imageCoordinate(loc.x) || !imageCoordinate(loc.y) ||
+         !imageCoordinate(loc.z)) {
+         throw Fwk::RangeException(loc.name());
+      }
+      order[i] = std::make_pair(mortonKey(loc), i);
+   }
+   std::sort(order.begin(), order.end());
+
+   TissueImageHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, imageMagic, sizeof(imageMagic));
+   h.version = imageVersion;
+   h.byteOrder = imageByteOrder;
+   h.cells = n;
+   h.cytotoxicCells = _cytotoxicCells;
+   h.helperCells = _helperCells;
+   h.infectedCells = _tissue->infectedCells();
+   if(h.infectedCells) {
+      Cell::Coordinates lo = _tissue->infectedMin();
+      Cell::Coordinates hi = _tissue->infectedMax();
+      h.infectedMin[0] = lo.x; h.infectedMin[1] = lo.y; h.infectedMin[2] = lo.z;
+      h.infectedMax[0] = hi.x; h.infectedMax[1] = hi.y; h.infectedMax[2] = hi.z;
+   }
+   h.keyOffset = sizeof(h);
+   h.cellOffset = h.keyOffset + U64(n) * sizeof(U64);
+
+   size_t base = _out.size();
+   _out.resize(base + h.cellOffset + U64(n) * sizeof(TissueImageCell));
+   char * p = &_out[base];
+   memcpy(p, &h, sizeof(h));
+   for( U32 i=0;i<n;++i) {
+      Cell const * c = _tissue->cellIndexed(order[i].second);
+      TissueImageCell ic;
+      memset(&ic, 0, sizeof(ic));
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         ic.antibodyStrength[s] = c->antibodyStrength(CellMembrane::Side(s)).value();
+      }
+      ic.cellType = U8(c->cellType());
+      ic.health = U8(c->health());
+      for( U32 s=CellMembrane::north_;s<=CellMembrane::down_;++s) {
+         if(c->membraneExists(CellMembrane::Side(s))) ic.membranes |= 1 << s;
+      }
+      memcpy(p + h.keyOffset + U64(i) * sizeof(U64), &order[i].first, sizeof(U64));
+      memcpy(p + h.cellOffset + U64(i) * sizeof(ic), &ic, sizeof(ic));
+   }
+}
+
+TissueImage::TissueImage(Fwk::String _path, StatsSink::Ptr _statsSink):
+      file_(Fwk::MappedFile::MappedFileNew(_path)),
+      statsSink_(_statsSink), infectedBoxStale_(false) {
+   char const * data = file_->data();
+   size_t size = file_->size();
+   header_ = reinterpret_cast<TissueImageHeader const *>(data);
+   if(size < sizeof(TissueImageHeader) ||
+      memcmp(header_->magic, imageMagic, sizeof(imageMagic)) != 0 ||
+      header_->version != imageVersion ||
+      header_->byteOrder != imageByteOrder ||
+      header_->keyOffset % sizeof(U64) ||
+      header_->keyOffset + U64(header_->cells) * sizeof(U64) > size ||
+      header_->cellOffset + U64(header_->cells) * sizeof(TissueImageCell) > size) {
+      throw Fwk::RangeException(_path);
+   }
+   key_ = reinterpret_cast<U64 const *>(data + header_->keyOffset);
+   cell_ = reinterpret_cast<TissueImageCell const *>(data + header_->cellOffset);
+   infectedCells_ = header_->infectedCells;
+   infectedMin_.x = header_->infectedMin[0];
+   infectedMin_.y = header_->infectedMin[1];
+   infectedMin_.z = header_->infectedMin[2];
+   infectedMax_.x = header_->infectedMax[0];
+   infectedMax_.y = header_->infectedMax[1];
+   infectedMax_.z = header_->infectedMax[2];
+}
+
+TissueImage::TissueImage(const TissueImage & _parent):
+      Fwk::PtrInterface<TissueImage>(),
+      file_(_parent.file_), header_(_parent.header_), key_(_parent.key_),
+      cell_(_parent.cell_), statsSink_(_parent.statsSink_),
+      healthWritten_(_parent.healthWritten_), infected_(_parent.infected_),
+      strength_(_parent.strength_), infectedCells_(_parent.infectedCells_),
+      infectedMin_(_parent.infectedMin_), infectedMax_(_parent.infectedMax_),
+      infectedBoxStale_(_parent.infectedBoxStale_) {
+}
+
+// Position of _key, searched outward from _hint in growing steps and then
+// by bisection, or noCell.
+U32
+TissueImage::keyIndex(U64 _key, U32 _hint) const {
+   U32 n = cells();
+   if(!n) return noCell;
+   U32 lo, hi;
+   // key_[lo] < _key <= key_[hi - 1], with lo == -1 or hi == n at the ends
+   if(key_[_hint] < _key) {
+      U32 step = 1;
+      lo = _hint;
+      while(lo + step < n && key_[lo + step] < _key) {
+         lo += step;
+         step <<= 1;
+      }
+      hi = std::min(n, lo + step + 1);
+      ++lo;
+   } else {
+      U32 step = 1;
+      hi = _hint + 1;
+      while(hi > step && key_[hi - 1 - step] >= _key) {
+         hi -= step;
+         step <<= 1;
+      }
+      lo = hi > step ? hi - 1 - step : 0;
+   }
+   U64 const * k = std::lower_bound(key_ + lo, key_ + hi, _key);
+   if(k == key_ + hi || *k != _key) return noCell;
+   return U32(k - key_);
+}
+
+U32
+TissueImage::cell(Cell::Coordinates _loc) const {
+   if(!imageCoordinate(_loc.x) || !imageCoordinate(_loc.y) ||
+      !imageCoordinate(_loc.z)) {
+      return noCell;
+   }
+   return keyIndex(mortonKey(_loc), cells() / 2);
+}
+
+U32
+TissueImage::neighbor(U32 _cell, CellMembrane::Side _side) const {
+   Cell::Coordinates loc = location(_cell).shifted(_side);
+   if(!imageCoordinate(loc.x) || !imageCoordinate(loc.y) ||
+      !imageCoordinate(loc.z)) {
+      return noCell;
+   }
+   return keyIndex(mortonKey(loc), _cell);
+}
+
+Cell::Coordinates
+TissueImage::location(U32 _cell) const {
+   U64 key = key_[_cell];
+   Cell::Coordinates loc;
+   loc.x = S32(mortonCompact(key)) - imageCoordinateBias;
+   loc.y = S32(mortonCompact(key >> 1)) - imageCoordinateBias;
+   loc.z = S32(mortonCompact(key >> 2)) - imageCoordinateBias;
+   return loc;
+}
+
+AntibodyStrength
+TissueImage::antibodyStrength(U32 _cell, CellMembrane::Side _side) const {
+   if(!strength_.empty()) {
+      std::map<U32, U8>::const_iterator s = strength_.find(_cell * 6 + _side);
+      if(s != strength_.end()) return AntibodyStrength(s->second);
+   }
+   return AntibodyStrength(cell_[_cell].antibodyStrength[_side]);
+}
+
+void
+TissueImage::antibodyStrengthIs(U32 _cell, CellMembrane::Side _side,
+                                AntibodyStrength _strength) {
+   strength_[_cell * 6 + _side] = _strength.value();
+}
+
+static void
+boxExtend(Cell::Coordinates & _min, Cell::Coordinates & _max, Cell::Coordinates _loc) {
+   if(_loc.x < _min.x) _min.x = _loc.x;
+   if(_loc.y < _min.y) _min.y = _loc.y;
+   if(_loc.z < _min.z) _min.z = _loc.z;
+   if(_loc.x > _max.x) _max.x = _loc.x;
+   if(_loc.y > _max.y) _max.y = _loc.y;
+   if(_loc.z > _max.z) _max.z = _loc.z;
+}
+
+void
+TissueImage::healthIs(U32 _cell, Cell::HealthId _health) {
+   bool was = health(_cell) == Cell::infected();
+   bool is = _health == Cell::infected();
+   // The overlay bitsets are only allocated on the first write.
+   if(!healthWritten_.size()) {
+      healthWritten_.sizeIs(cells());
+      infected_.sizeIs(cells());
+   }
+   healthWritten_.bitIs(_cell, true);
+   infected_.bitIs(_cell, is);
+   if(was == is) return;
+   Cell::Coordinates loc = location(_cell);
+   if(is) {
+      if(++infectedCells_ == 1) {
+         infectedMin_ = infectedMax_ = loc;
+         infectedBoxStale_ = false;
+      } else if(!infectedBoxStale_) {
+         boxExtend(infectedMin_, infectedMax_, loc);
+      }
+   } else {
+      --infectedCells_;
+      if(loc.x == infectedMin_.x || loc.y == infectedMin_.y ||
+         loc.z == infectedMin_.z || loc.x == infectedMax_.x ||
+         loc.y == infectedMax_.y || loc.z == infectedMax_.z) {
+         infectedBoxStale_ = true;
+      }
+   }
+}
+
+void
+TissueImage::infectedBoxRescan() const {
+   infectedBoxStale_ = false;
+   bool first = true;
+   for( U32 i=0;i<cells();++i) {
+      if(health(i) != Cell::infected()) continue;
+      Cell::Coordinates loc = location(i);
+      if(first) {
+         infectedMin_ = infectedMax_ = loc;
+         first = false;
+         continue;
+      }
+      boxExtend(infectedMin_, infectedMax_, loc);
+   }
+}
+
+U32
+TissueImage::infectionVolume() const {
+   if(!infectedCells_) return 0;
+   if(infectedBoxStale_) infectedBoxRescan();
+   return (infectedMax_.x - infectedMin_.x + 1) *
+          (infectedMax_.y - infectedMin_.y + 1) *
+          (infectedMax_.z - infectedMin_.z + 1);
+}
+
+bool
+TissueImage::infectionSpreadTo(U32 _cell, CellMembrane::Side _side,
+                               AntibodyStrength _attack, S32 & _difference,
+                               U32 & _attempts) {
+   if(_cell == noCell || health(_cell) == Cell::infected()) return false;
+   ++_attempts;
+   AntibodyStrength defense = antibodyStrength(_cell, _side);
+   _difference += (S32)_attack.value() - (S32)defense.value();
+   if(_attack > defense) {
+      healthIs(_cell, Cell::infected());
+      return true;
+   }
+   return false;
+}
+
+// Order in which a cell attacks its neighbors, as in Simulation.
+static const CellMembrane::Side imageInfectionSide[] = {
+   CellMembrane::north_, CellMembrane::east_, CellMembrane::south_,
+   CellMembrane::west_, CellMembrane::up_, CellMembrane::down_
+};
+
+void
+TissueImage::infectionStart(Cell::Coordinates _loc, CellMembrane::Side _side,
+                            AntibodyStrength _strength) {
+   U32 attempts = 0;
+   S32 difference = 0;
+   U32 path = 0;
+   U32 root = cell(_loc);
+   if(infectionSpreadTo(root, _side, _strength, difference, attempts)) {
+      std::vector<U32> cur(1, root), next;
+      while(!cur.empty()) {
+         next.clear();
+         for( U32 j=0;j<cur.size();++j) {
+            for( U32 k=0;k<6;++k) {
+               CellMembrane::Side side = imageInfectionSide[k];
+               U32 n = neighbor(cur[j], side);
+               if(infectionSpreadTo(n, CellMembrane::opposite(side), _strength,
+                                    difference, attempts)) {
+                  next.push_back(n);
+               }
+            }
+         }
+         cur.swap(next);
+         ++path;
+      }
+   }
+   if(!statsSink_) return;
+   InfectionStats s;
+   s.infectedCells = infectedCells_;
+   s.attempts = attempts;
+   s.difference = difference;
+   s.cytotoxicCells = cytotoxicCells();
+   s.helperCells = helperCells();
+   s.volume = infectionVolume();
+   s.path = path;
+   statsSink_->statsNew(file_->path(), s);
+}
@@ -0,0 +1,156 @@
+// TissueImage.h
+
+#ifndef TISSUEIMAGE_H
+#define TISSUEIMAGE_H
+
+#include <map>
+#include <vector>
+#include "fwk/Bitset.h"
+#include "fwk/MappedFile.h"
+#include "Tissue.h"
+#include "stats.h"
+
+/*
+  Read-only tissue image, used in place without building Cell objects.
+
+  An image holds a header, then the Morton key of every cell in ascending
+  order, then a TissueImageCell per cell in the same order.  Sections are
+  found by offsets from the start of the image and nothing in it is a
+  pointer, so an image is mapped and used as is: opening one costs the
+  same for any number of cells.  The key interleaves the bits of the
+  coordinates, each offset by imageCoordinateBias, so cells close in space
+  are mostly close in the image and a neighbor is found by a short search
+  from the cell next to it.  Images are written in host byte order; one
+  from a host of the other order is refused.
+
+  Changes go to an overlay owned by the TissueImage and never to the
+  mapped file, so any number of TissueImages may share an image.
+*/
+
+struct TissueImageHeader {
+   char magic[4];
+   U32 version;
+   U32 byteOrder;
+   U32 cells;
+   U32 cytotoxicCells;
+   U32 helperCells;
+   U32 infectedCells;
+   S32 infectedMin[3];
+   S32 infectedMax[3];
+   U32 reserved;
+   U64 keyOffset;
+   U64 cellOffset;
+};
+
+struct TissueImageCell {
+   U8 antibodyStrength[6];
+   U8 cellType;
+   U8 health;
+   U8 membranes;
+   U8 reserved[3];
+};
+
+static const char imageMagic[4] = {'H', 'I', 'V', 'I'};
+static const U32 imageVersion = 1;
+static const U32 imageByteOrder = 0x01020304;
+static const S32 imageCoordinateBias = 1 << 20;
+// Coordinates must lie in [-imageCoordinateBias, imageCoordinateBias).
+
+class TissueImage : public Fwk::PtrInterface<TissueImage> {
+public:
+   typedef Fwk::Ptr<TissueImage const> PtrConst;
+   typedef Fwk::Ptr<TissueImage> Ptr;
+
+   static const U32 noCell = 0xffffffff;
+
+   static void imageWrite(Tissue const * _tissue, U32 _cytotoxicCells,
+                          U32 _helperCells, std::vector<char> & _out);
+   // Appends the image of _tissue, with the cell counters of its
+   // simulation.  Throws RangeException if a coordinate is out of range.
+
+   static TissueImage::Ptr TissueImageNew(Fwk::String _path,
+      StatsSink::Ptr _statsSink = StatsSink::standardOut()) {
+      Ptr m = new TissueImage(_path, _statsSink);
+      m->referencesDec(1);
+      // decr. refer count to compensate for initial val of 1
+      return m;
+   }
+   // Maps the image at _path.  Throws ErrnoException if it cannot be mapped
+   // and RangeException if it is not a valid image.
+
+   TissueImage::Ptr fork() const {
+      Ptr m = new TissueImage(*this);
+      m->referencesDec(1);
+      return m;
+   }
+   // A child sharing the mapped image, with a copy of the overlay; what
+   // either changes from then on is its own.
+
+   Fwk::MappedFile::PtrConst file() const { return file_; }
+   U32 cells() const { return header_->cells; }
+   U32 cytotoxicCells() const { return header_->cytotoxicCells; }
+   U32 helperCells() const { return header_->helperCells; }
+
+   U32 cell(Cell::Coordinates _loc) const;
+   // Index of the cell at _loc, or noCell.
+   U32 neighbor(U32 _cell, CellMembrane::Side _side) const;
+   Cell::Coordinates location(U32 _cell) const;
+   Cell::CellType cellType(U32 _cell) const {
+      return Cell::CellType(cell_[_cell].cellType);
+   }
+   Cell::HealthId health(U32 _cell) const {
+      if(healthWritten_.size() && healthWritten_.bit(_cell)) {
+         return infected_.bit(_cell) ? Cell::infected() : Cell::healthy();
+      }
+      return Cell::HealthId(cell_[_cell].health);
+   }
+   AntibodyStrength antibodyStrength(U32 _cell, CellMembrane::Side _side) const;
+   bool membraneExists(U32 _cell, CellMembrane::Side _side) const {
+      return cell_[_cell].membranes & (1 << _side);
+   }
+   // Cells are numbered in image order.  Reads see the overlay.
+
+   U32 infectedCells() const { return infectedCells_; }
+   U32 infectionVolume() const;
+
+   void healthIs(U32 _cell, Cell::HealthId _health);
+   void antibodyStrengthIs(U32 _cell, CellMembrane::Side _side,
+                           AntibodyStrength _strength);
+   // Recorded in the overlay.
+   U32 overlayCells() const { return healthWritten_.members() + strength_.size(); }
+
+   StatsSink::Ptr statsSink() const { return statsSink_; }
+   void statsSinkIs(StatsSink::Ptr _sink) { statsSink_ = _sink; }
+
+   void infectionStart(Cell::Coordinates _loc, CellMembrane::Side _side,
+                       AntibodyStrength _strength);
+   // As Simulation::infectionStart, with the same statistics, run over
+   // the image and its overlay.
+
+protected:
+   TissueImage( const TissueImage& _parent );
+   TissueImage(Fwk::String _path, StatsSink::Ptr _statsSink);
+
+   U32 keyIndex(U64 _key, U32 _hint) const;
+   bool infectionSpreadTo(U32 _cell, CellMembrane::Side _side,
+                          AntibodyStrength _attack, S32 & _difference,
+                          U32 & _attempts);
+   void infectedBoxRescan() const;
+
+   Fwk::MappedFile::Ptr file_;
+   TissueImageHeader const * header_;
+   U64 const * key_;
+   TissueImageCell const * cell_;
+   StatsSink::Ptr statsSink_;
+   Fwk::Bitset healthWritten_;
+   Fwk::Bitset infected_;
+   std::map<U32, U8> strength_;
+   // Overlay: health of the cells marked in healthWritten_, and strengths
+   // by cell * 6 + side.
+   U32 infectedCells_;
+   mutable Cell::Coordinates infectedMin_;
+   mutable Cell::Coordinates infectedMax_;
+   mutable bool infectedBoxStale_;
+};
+
+#endif
@@ -0,0 +1,734 @@
+#include <string.h>
+#include "command.h"
+
+/*
+  Text form.  A Token is a slice of one line; tokens are separated by
+  single spaces and nothing is copied unless a tissue name is interned or
+  an error reported.
+*/
+
+struct Token {
+  char const *begin;
+  U32 size;
+
+  template <size_t N>
+  bool is(char const (&word)[N]) const {
+    return size == N - 1 && memcmp(begin, word, N - 1) == 0;
+  }
+  Fwk::String string() const { return Fwk::String(begin, size); }
+};
+
+class CommandLine {
+public:
+  CommandLine(char const *begin, char const *end) : next_(begin), end_(end) {}
+
+  // next token, empty once the line is used up
+  Token token() {
+    while (next_ < end_ && *next_ == ' ')
+      next_++;
+    Token t;
+    t.begin = next_;
+    while (next_ < end_ && *next_ != ' ')
+      next_++;
+    t.size = next_ - t.begin;
+    return t;
+  }
+
+private:
+  char const *next_;
+  char const *end_;
+};
+
+// Parses a decimal integer with an optional sign, as lexical_cast<S32>
+// would, without allocating.
+static S32 integerIs(Token t)
+{
+  char const *p = t.begin;
+  char const *end = t.begin + t.size;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  if (p == end)
+    throw "Malformed number";
+  S64 value = 0;
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9')
+      throw "Malformed number";
+    value = value * 10 + (*p - '0');
+    if (value > S64(0x80000000))
+      throw "Number out of range";
+  }
+  if (!negative && value > S64(0x7fffffff))
+    throw "Number out of range";
+  return negative ? -value : value;
+}
+
+static Cell::Coordinates coordinateIs(CommandLine &line)
+{
+  Cell::Coordinates loc;
+  loc.x = integerIs(line.token());
+  loc.y = integerIs(line.token());
+  loc.z = integerIs(line.token());
+  return loc;
+}
+
+static char const *const sideName[] = {
+  "north", "south", "east", "west", "up", "down"
+};
+
+static CellMembrane::Side sideIs(Token token)
+{
+  if (token.is("north"))
+    return CellMembrane::north_;
+
+  if (token.is("south"))
+    return CellMembrane::south_;
+
+  if (token.is("east"))
+    return CellMembrane::east_;
+
+  if (token.is("west"))
+    return CellMembrane::west_;
+
+  if (token.is("up"))
+    return CellMembrane::up_;
+
+  if (token.is("down"))
+    return CellMembrane::down_;
+
+  throw "Unrecognized membrane side";
+}
+
+// Parses the seeds of infectionStartLocationsIs, "x y z side" each, into
+// seeds if given, and returns how many there are.
+static U32 seedsIs(char const *begin, U32 size,
+                   vector<InfectionSeed> *seeds = 0)
+{
+  char const *end = begin + size;
+  CommandLine line(begin, end);
+  U32 count = 0;
+  for (Token t = line.token(); t.size; t = line.token()) {
+    line = CommandLine(t.begin, end);
+    InfectionSeed s;
+    s.loc = coordinateIs(line);
+    s.side = sideIs(line.token());
+    if (seeds)
+      seeds->push_back(s);
+    count++;
+  }
+  if (!count)
+    throw "Malformed command";
+  return count;
+}
+
+bool CommandParser::commandIs(char const *begin, char const *end,
+                              Command &cmd)
+{
+  if (begin == end || begin[0] == '#')
+    return false;
+
+  CommandLine line(begin, end);
+  Token token = line.token();
+  cmd.text = 0;
+  cmd.textSize = 0;
+
+  if (token.is("Tissue")) {
+    token = line.token();
+    if (token.is("tissueNew")) {
+      Token name = line.token();
+      Tissue::CellStorage storage = Tissue::hashedStorage();
+      token = line.token();
+      if (token.size)
+        storage = Tissue::CellStorageInstance(token.string());
+      cmd.op = Command::tissueNew_;
+      cmd.tissue = tissues_->tissueIdNew(name.begin, name.size);
+      cmd.value = storage;
+      cmd.text = name.begin;
+      cmd.textSize = name.size;
+      return true;
+    }
+    cmd.tissue = tissues_->tissueId(token.begin, token.size);
+    token = line.token();
+    if (token.is("cytotoxicCellNew")) {
+      cmd.op = Command::cytotoxicCellNew_;
+      cmd.loc = coordinateIs(line);
+    } else if (token.is("helperCellNew")) {
+      cmd.op = Command::helperCellNew_;
+      cmd.loc = coordinateIs(line);
+    } else if (token.is("infectionStartLocationIs")) {
+      cmd.op = Command::infectionStartLocationIs_;
+      cmd.loc = coordinateIs(line);
+      cmd.side = sideIs(line.token());
+      cmd.strength = U8(integerIs(line.token()));
+    } else if (token.is("infectionStartLocationsIs")) {
+      cmd.op = Command::infectionStartLocationsIs_;
+      cmd.strength = U8(integerIs(line.token()));
+      Token seed = line.token();
+      cmd.text = seed.begin;
+      cmd.textSize = end - seed.begin;
+      cmd.value = seedsIs(cmd.text, cmd.textSize);
+    } else if (token.is("infectedCellsDel")) {
+      cmd.op = Command::infectedCellsDel_;
+    } else if (token.is("infectionThreadsIs")) {
+      cmd.op = Command::infectionThreadsIs_;
+      cmd.value = U32(integerIs(line.token()));
+    } else if (token.is("notificationDeferredIs")) {
+      cmd.op = Command::notificationDeferredIs_;
+      cmd.value = line.token().is("true");
+    } else if (token.is("cloneCellsNew")) {
+      cmd.op = Command::cloneCellsNew_;
+      cmd.side = sideIs(line.token());
+    } else if (token.is("snapshotWrite") || token.is("snapshotRead") ||
+               token.is("imageWrite")) {
+      cmd.op = token.is("snapshotWrite") ? Command::snapshotWrite_ :
+        token.is("snapshotRead") ? Command::snapshotRead_ : 
+        Command::imageWrite_;
+      Token path = line.token();
+      if (!path.size)
+        throw "Malformed command";
+      cmd.text = path.begin;
+      cmd.textSize = path.size;
+    } else if (token.is("fork")) {
+      Token name = line.token();
+      if (!name.size)
+        throw "Malformed command";
+      cmd.op = Command::fork_;
+      cmd.value = tissues_->tissueIdNew(name.begin, name.size);
+      cmd.text = name.begin;
+      cmd.textSize = name.size;
+    } else {
+      throw "Malformed command";
+    }
+  } else if (token.is("Cell")) {
+    token = line.token();
+    cmd.tissue = tissues_->tissueId(token.begin, token.size);
+    cmd.loc = coordinateIs(line);
+    token = line.token();
+    if (token.is("membrane")) {
+      cmd.side = sideIs(line.token());
+      token = line.token();
+      if (token.is("antibodyStrengthIs")) {
+        cmd.op = Command::antibodyStrengthIs_;
+        cmd.strength = U8(integerIs(line.token()));
+      } else {
+        throw "Malformed command";
+      }
+    } else if (token.is("cloneNew")) {
+      cmd.op = Command::cloneNew_;
+      cmd.side = sideIs(line.token());
+    } else {
+      throw "Malformed command";
+    }
+  } else {
+    throw "Malformed command";
+  }
+  return true;
+}
+
+/*
+  Binary form.  Each opcode's operands, in the order they are stored.
+*/
+
+enum {
+  tissueOperand = 1,
+  locOperand = 2,
+  sideOperand = 4,
+  strengthOperand = 8,
+  flagOperand = 16,
+  valueOperand = 32,
+  textOperand = 64
+};
+
+static const U8 commandOperands[Command::ops_] = {
+  0,
+  tissueOperand | flagOperand | textOperand,             // tissueNew_
+  tissueOperand | locOperand,                            // cytotoxicCellNew_
+  tissueOperand | locOperand,                            // helperCellNew_
+  tissueOperand | locOperand | sideOperand | strengthOperand,
+                                                 // infectionStartLocationIs_
+  tissueOperand,                                         // infectedCellsDel_
+  tissueOperand | valueOperand,                          // infectionThreadsIs_
+  tissueOperand | flagOperand,                       // notificationDeferredIs_
+  tissueOperand | sideOperand,                           // cloneCellsNew_
+  tissueOperand | locOperand | sideOperand | strengthOperand,
+                                                       // antibodyStrengthIs_
+  tissueOperand | locOperand | sideOperand,              // cloneNew_
+  textOperand,                                           // malformed_
+  tissueOperand | textOperand,                           // snapshotWrite_
+  tissueOperand | textOperand,                           // snapshotRead_
+  tissueOperand | textOperand,                           // imageWrite_
+  tissueOperand | valueOperand | textOperand,            // fork_
+  tissueOperand | strengthOperand | valueOperand | textOperand
+                                                // infectionStartLocationsIs_
+};
+
+static void bytesWrite(U32 value, U32 bytes, std::vector<char> &out)
+{
+  for (U32 i = 0; i < bytes; i++)
+    out.push_back(char(value >> (8 * i)));
+}
+
+static U32 bytesRead(char const *&next, U32 bytes)
+{
+  U32 value = 0;
+  for (U32 i = 0; i < bytes; i++)
+    value |= U32(U8(next[i])) << (8 * i);
+  next += bytes;
+  return value;
+}
+
+void commandHeaderWrite(std::vector<char> &out)
+{
+  out.insert(out.end(), commandMagic, commandMagic + sizeof(commandMagic));
+  bytesWrite(commandVersion, 4, out);
+}
+
+bool commandBinary(char const *begin, char const *end)
+{
+  return end - begin >= 8 &&
+         memcmp(begin, commandMagic, sizeof(commandMagic)) == 0;
+}
+
+void commandWrite(Command const &cmd, std::vector<char> &out)
+{
+  U8 operands = commandOperands[cmd.op];
+  out.push_back(char(cmd.op));
+  if (operands & tissueOperand)
+    bytesWrite(cmd.tissue, 2, out);
+  if (operands & locOperand) {
+    bytesWrite(U32(cmd.loc.x), 4, out);
+    bytesWrite(U32(cmd.loc.y), 4, out);
+    bytesWrite(U32(cmd.loc.z), 4, out);
+  }
+  if (operands & sideOperand)
+    bytesWrite(cmd.side, 1, out);
+  if (operands & strengthOperand)
+    bytesWrite(cmd.strength, 1, out);
+  if (operands & flagOperand)
+    bytesWrite(cmd.value, 1, out);
+  if (operands & valueOperand)
+    bytesWrite(cmd.value, 4, out);
+  if (operands & textOperand) {
+    bytesWrite(cmd.textSize, 4, out);
+    out.insert(out.end(), cmd.text, cmd.text + cmd.textSize);
+  }
+}
+
+char const *commandRead(char const *next, char const *end, Command &cmd)
+{
+  U8 op = U8(*next++);
+  if (op == 0 || op >= Command::ops_)
+    throw "Unknown command opcode";
+  U8 operands = commandOperands[op];
+  U32 size = ((operands & tissueOperand) ? 2 : 0) +
+             ((operands & locOperand) ? 12 : 0) +
+             ((operands & sideOperand) ? 1 : 0) +
+             ((operands & strengthOperand) ? 1 : 0) +
+             ((operands & flagOperand) ? 1 : 0) +
+             ((operands & valueOperand) ? 4 : 0) +
+             ((operands & textOperand) ? 4 : 0);
+  if (U32(end - next) < size)
+    throw "Truncated command";
+
+  cmd.op = Command::Op(op);
+  cmd.text = 0;
+  cmd.textSize = 0;
+  if (operands & tissueOperand)
+    cmd.tissue = U16(bytesRead(next, 2));
+  if (operands & locOperand) {
+    cmd.loc.x = S32(bytesRead(next, 4));
+    cmd.loc.y = S32(bytesRead(next, 4));
+    cmd.loc.z = S32(bytesRead(next, 4));
+  }
+  if (operands & sideOperand) {
+    U32 side = bytesRead(next, 1);
+    if (side > CellMembrane::down_)
+      throw "Unrecognized membrane side";
+    cmd.side = CellMembrane::Side(side);
+  }
+  if (operands & strengthOperand)
+    cmd.strength = U8(bytesRead(next, 1));
+  if (operands & flagOperand)
+    cmd.value = bytesRead(next, 1);
+  if (operands & valueOperand)
+    cmd.value = bytesRead(next, 4);
+  if (operands & textOperand) {
+    cmd.textSize = bytesRead(next, 4);
+    if (U32(end - next) < cmd.textSize)
+      throw "Truncated command";
+    cmd.text = next;
+    next += cmd.textSize;
+  }
+  return next;
+}
+
+Fwk::String commandText(Command const &cmd, CommandTissues const &tissues)
+{
+  if (cmd.op == Command::malformed_)
+    return Fwk::String(cmd.text, cmd.textSize);
+
+  Fwk::StringBuf s;
+  Cell::Coordinates loc = cmd.loc;
+  if (cmd.op == Command::antibodyStrengthIs_ || cmd.op == Command::cloneNew_)
+    s << "Cell " << tissues.name(cmd.tissue) << " "
+      << loc.x << " " << loc.y << " " << loc.z << " ";
+  else
+    s << "Tissue ";
+
+  switch (cmd.op) {
+    case Command::tissueNew_:
+      s << "tissueNew " << Fwk::String(cmd.text, cmd.textSize);
+      if (cmd.value == Tissue::chunkedStorage_)
+        s << " chunked";
+      else if (cmd.value == Tissue::shardedStorage_)
+        s << " sharded";
+      break;
+    case Command::cytotoxicCellNew_:
+    case Command::helperCellNew_:
+      s << tissues.name(cmd.tissue) << " "
+        << (cmd.op == Command::cytotoxicCellNew_ ?
+            "cytotoxicCellNew " : "helperCellNew ")
+        << loc.x << " " << loc.y << " " << loc.z;
+      break;
+    case Command::infectionStartLocationIs_:
+      s << tissues.name(cmd.tissue) << " infectionStartLocationIs "
+        << loc.x << " " << loc.y << " " << loc.z << " "
+        << sideName[cmd.side] << " " << U32(cmd.strength);
+      break;
+    case Command::infectionStartLocationsIs_:
+      s << tissues.name(cmd.tissue) << " infectionStartLocationsIs "
+        << U32(cmd.strength) << " " << Fwk::String(cmd.text, cmd.textSize);
+      break;
+    case Command::infectedCellsDel_:
+      s << tissues.name(cmd.tissue) << " infectedCellsDel";
+      break;
+    case Command::infectionThreadsIs_:
+      s << tissues.name(cmd.tissue) << " infectionThreadsIs " << cmd.value;
+      break;
+    case Command::notificationDeferredIs_:
+      s << tissues.name(cmd.tissue) << " notificationDeferredIs "
+        << (cmd.value ? "true" : "false");
+      break;
+    case Command::cloneCellsNew_:
+      s << tissues.name(cmd.tissue) << " cloneCellsNew "
+        << sideName[cmd.side];
+      break;
+    case Command::snapshotWrite_:
+    case Command::snapshotRead_:
+    case Command::imageWrite_:
+      s << tissues.name(cmd.tissue)
+        << (cmd.op == Command::snapshotWrite_ ? " snapshotWrite " :
+            cmd.op == Command::snapshotRead_ ? " snapshotRead " : 
+            " imageWrite ")
+        << Fwk::String(cmd.text, cmd.textSize);
+      break;
+    case Command::fork_:
+      s << tissues.name(cmd.tissue) << " fork "
+        << Fwk::String(cmd.text, cmd.textSize);
+      break;
+    case Command::antibodyStrengthIs_:
+      s << "membrane " << sideName[cmd.side] << " antibodyStrengthIs "
+        << U32(cmd.strength);
+      break;
+    case Command::cloneNew_:
+      s << "cloneNew " << sideName[cmd.side];
+      break;
+    default:
+      break;
+  }
+  return s;
+}
+
+/*
+  Tissue names.
+*/
+
+U16 CommandTissues::tissueId(char const *name, U32 size)
+{
+  if (last_ < name_.size() && name_[last_].size() == size &&
+      memcmp(name_[last_].data(), name, size) == 0)
+    return last_;
+  IdMap::iterator i = id_.find(Fwk::String(name, size));
+  if (i == id_.end())
+    throw "Unknown tissue";
+  last_ = i->second;
+  return last_;
+}
+
+U16 CommandTissues::tissueIdNew(char const *name, U32 size)
+{
+  Fwk::String s(name, size);
+  IdMap::iterator i = id_.find(s);
+  if (i != id_.end())
+    return i->second;
+  if (name_.size() > 0xffff)
+    throw "Too many tissues";
+  U16 id = name_.size();
+  id_[s] = id;
+  name_.push_back(s);
+  return id;
+}
+
+/*
+  Programs.
+*/
+
+void CommandProgram::textCompile(char const *next, char const *end)
+{
+  CommandParser parser(&tissues_);
+  Command cmd;
+  for (;;) {
+    char const *eol = next ? 
+      static_cast<char const *>(memchr(next, '\n', end - next)) : 0;
+    if (!eol)
+      eol = end;
+    bool isCommand;
+    try {
+      isCommand = parser.commandIs(next, eol, cmd);
+    }
+    catch (...) {
+      cmd.op = Command::malformed_;
+      cmd.text = next;
+      cmd.textSize = eol - next;
+      isCommand = true;
+    }
+    if (isCommand) {
+      cmd.source = next;
+      cmd.sourceSize = eol - next;
+      command_.push_back(cmd);
+    }
+    if (eol == end)
+      break;
+    next = eol + 1;
+  }
+  simulationsLinked();
+}
+
+void CommandProgram::binaryCompile(char const *next, char const *end)
+{
+  if (!commandBinary(next, end))
+    throw "Not a binary command file";
+  Command cmd;
+  cmd.source = 0;
+  cmd.sourceSize = 0;
+  for (next += 8; next < end; ) {
+    next = commandRead(next, end, cmd);
+    if (cmd.op == Command::tissueNew_ &&
+        tissues_.tissueIdNew(cmd.text, cmd.textSize) != cmd.tissue)
+      throw "Inconsistent tissue id";
+    if (cmd.op == Command::fork_ &&
+        tissues_.tissueIdNew(cmd.text, cmd.textSize) != cmd.value)
+      throw "Inconsistent tissue id";
+    if (cmd.op == Command::infectionStartLocationsIs_ &&
+        seedsIs(cmd.text, cmd.textSize) != cmd.value)
+      throw "Inconsistent seed count";
+    if (cmd.op != Command::malformed_ && cmd.tissue >= tissues_.tissues())
+      throw "Unknown tissue id";
+    command_.push_back(cmd);
+  }
+  simulationsLinked();
+}
+
+// Points each command at its tissue's slot, now that the number of
+// tissues, and so the slot addresses, are final.
+void CommandProgram::simulationsLinked()
+{
+  simulation_.resize(tissues_.tissues());
+  for (U32 i = 0; i < command_.size(); i++) {
+    Command &cmd = command_[i];
+    cmd.simulation = cmd.op == Command::malformed_ ? 0 : 
+      &simulation_[cmd.tissue];
+  }
+}
+
+void CommandProgram::commandFailed(Command const &cmd)
+{
+  // keep the report after the stats of the commands before it
+  statsSink_->flush();
+  cerr << "Excetion occurred while parseing command: [" 
+    << (cmd.source ? Fwk::String(cmd.source, cmd.sourceSize) : 
+        commandText(cmd, tissues_)) << "]" << endl;
+}
+
+// One tissue's commands, as run by a worker, and what they printed: the
+// stats written by command k end at end[k] in out, a sink in memory.
+struct CommandProgram::TissueStream {
+  vector<U32> command;
+  StatsSink::Ptr out;
+  vector<U32> end;
+  vector<bool> failed;
+};
+
+struct CommandProgram::TissueStreams {
+  CommandProgram *program;
+  vector<CommandProgram::TissueStream *> *stream;
+  U32 next;
+};
+
+void *CommandProgram::tissueStreamsRun(void *arg)
+{
+  TissueStreams *streams = static_cast<TissueStreams *>(arg);
+  for (;;) {
+    U32 i = __sync_fetch_and_add(&streams->next, 1);
+    if (i >= streams->stream->size())
+      return 0;
+    streams->program->tissueStreamRun(*(*streams->stream)[i]);
+  }
+}
+
+void CommandProgram::tissueStreamRun(TissueStream &stream)
+{
+  for (U32 k = 0; k < stream.command.size(); k++) {
+    Command const &cmd = command_[stream.command[k]];
+    bool failed = false;
+    try {
+      commandRun(cmd, stream.out);
+    }
+    catch (...) {
+      failed = true;
+    }
+    if (*cmd.simulation)
+      (*cmd.simulation)->tissue()->notificationsDispatch();
+    stream.end.push_back(stream.out->bytes());
+    stream.failed.push_back(failed);
+  }
+}
+
+void CommandProgram::run(U32 threads)
+{
+  for (U32 i = 0; i < simulation_.size(); i++)
+    simulation_[i] = 0;
+
+  // Tissues may pass snapshots to each other through files, in script
+  // order; such programs run serially.
+  for (U32 i = 0; i < command_.size() && threads > 1; i++)
+    if (command_[i].op == Command::snapshotWrite_ ||
+        command_[i].op == Command::snapshotRead_ ||
+        command_[i].op == Command::imageWrite_ ||
+        command_[i].op == Command::fork_)
+      threads = 1;
+
+  if (threads <= 1 || simulation_.size() <= 1) {
+    for (U32 i = 0; i < command_.size(); i++) {
+      Command const &cmd = command_[i];
+      try {
+        commandRun(cmd, statsSink_);
+      }
+      catch (...) {
+        commandFailed(cmd);
+      }
+      // deliver notifications deferred during the command
+      for (U32 t = 0; t < simulation_.size(); t++)
+        if (simulation_[t])
+          simulation_[t]->tissue()->notificationsDispatch();
+    }
+    statsSink_->flush();
+    return;
+  }
+
+  // Tissues never share state, so each one's commands can run on their
+  // own, with their simulations writing stats to the stream's buffer.
+  vector<TissueStream *> stream(simulation_.size());
+  for (U32 t = 0; t < stream.size(); t++) {
+    stream[t] = new TissueStream;
+    stream[t]->out = StatsSink::StatsSinkNew(statsSink_->format(), 0);
+  }
+  for (U32 i = 0; i < command_.size(); i++)
+    if (command_[i].op != Command::malformed_)
+      stream[command_[i].tissue]->command.push_back(i);
+
+  TissueStreams streams;
+  streams.program = this;
+  streams.stream = &stream;
+  streams.next = 0;
+  if (threads > stream.size())
+    threads = stream.size();
+  Simulation::workersRun(tissueStreamsRun, &streams, threads);
+
+  vector<U32> next(stream.size(), 0);
+  for (U32 i = 0; i < command_.size(); i++) {
+    Command const &cmd = command_[i];
+    if (cmd.op == Command::malformed_) {
+      commandFailed(cmd);
+      continue;
+    }
+    TissueStream &s = *stream[cmd.tissue];
+    U32 k = next[cmd.tissue]++;
+    U32 begin = k ? s.end[k - 1] : 0;
+    if (s.end[k] > begin)
+      statsSink_->bytesNew(s.out->data() + begin, s.end[k] - begin);
+    if (s.failed[k])
+      commandFailed(cmd);
+  }
+  statsSink_->flush();
+  for (U32 t = 0; t < stream.size(); t++)
+    delete stream[t];
+}
+
+void CommandProgram::commandRun(Command const &cmd, StatsSink::Ptr statsSink)
+{
+  if (cmd.op == Command::tissueNew_) {
+    *cmd.simulation = Simulation::SimulationNew(
+      Fwk::String(cmd.text, cmd.textSize), Tissue::CellStorage(cmd.value),
+      statsSink);
+    return;
+  }
+  if (cmd.op == Command::malformed_)
+    throw "Malformed command";
+
+  Simulation *curSim = cmd.simulation->ptr();
+  if (!curSim)
+    throw "Unknown tissue";
+  switch (cmd.op) {
+    case Command::cytotoxicCellNew_:
+      curSim->cellNew(cmd.loc, Cell::cytotoxicCell());
+      break;
+    case Command::helperCellNew_:
+      curSim->cellNew(cmd.loc, Cell::helperCell());
+      break;
+    case Command::infectionStartLocationIs_:
+      curSim->infectionStart(cmd.loc, cmd.side, AntibodyStrength(cmd.strength));
+      break;
+    case Command::infectionStartLocationsIs_: {
+      vector<InfectionSeed> seeds;
+      seeds.reserve(cmd.value);
+      seedsIs(cmd.text, cmd.textSize, &seeds);
+      curSim->infectionStart(seeds, AntibodyStrength(cmd.strength));
+      break;
+    }
+    case Command::infectedCellsDel_:
+      curSim->infectedCellsDel();
+      break;
+    case Command::infectionThreadsIs_:
+      curSim->infectionThreadsIs(cmd.value);
+      break;
+    case Command::notificationDeferredIs_:
+      curSim->tissue()->notificationDeferredIs(cmd.value != 0);
+      break;
+    case Command::cloneCellsNew_:
+      curSim->cloneCellsNew(cmd.side);
+      break;
+    case Command::antibodyStrengthIs_:
+      curSim->antibodyStrengthIs(cmd.loc, cmd.side,
+                                 AntibodyStrength(cmd.strength));
+      break;
+    case Command::cloneNew_:
+      curSim->cloneNew(cmd.loc, cmd.side);
+      break;
+    case Command::snapshotWrite_:
+      curSim->snapshotWrite(Fwk::String(cmd.text, cmd.textSize));
+      break;
+    case Command::snapshotRead_:
+      curSim->snapshotRead(Fwk::String(cmd.text, cmd.textSize));
+      break;
+    case Command::imageWrite_:
+      curSim->imageWrite(Fwk::String(cmd.text, cmd.textSize));
+      break;
+    case Command::fork_:
+      simulation_[cmd.value] = 
+        curSim->fork(Fwk::String(cmd.text, cmd.textSize));
+      break;
+    default:
+      throw "Malformed command";
+  }
+}
@@ -0,0 +1,172 @@
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <map>
+#include <vector>
+#include "fwk/MappedFile.h"
+#include "simulation.h"
+
+/*
+  Commands of the rules DSL, in two encodings.
+
+  The text form is one command per line, e.g.
+    Cell Tissue1 0 0 0 membrane north antibodyStrengthIs 100
+  and is parsed in place, without copying, by CommandParser.
+
+  The binary form starts with commandMagic and a version word, followed by
+  one record per command: an opcode byte and then that opcode's operands,
+  packed little-endian in a fixed order (tissue id, coordinates, side,
+  strength, value, text) as given by its entry in the operand table.
+  Tissue names are interned: tissueNew carries the name and gives it a
+  small id that every later command uses.  A text line that failed to parse
+  is kept as a malformed_ record holding the line, so that running the
+  binary form reports the same errors as running the text.
+
+  Either form is compiled into a CommandProgram before anything runs:
+  tissue ids are bound to simulation slots, so running a command is a
+  switch on its opcode with no lookups, and a program can be run again
+  without parsing.
+*/
+
+struct Command {
+  enum Op {
+    tissueNew_ = 1,
+    cytotoxicCellNew_,
+    helperCellNew_,
+    infectionStartLocationIs_,
+    infectedCellsDel_,
+    infectionThreadsIs_,
+    notificationDeferredIs_,
+    cloneCellsNew_,
+    antibodyStrengthIs_,
+    cloneNew_,
+    malformed_,
+    snapshotWrite_,
+    snapshotRead_,
+    imageWrite_,
+    fork_,
+    infectionStartLocationsIs_,
+    ops_
+  };
+
+  Op op;
+  U16 tissue;
+  Cell::Coordinates loc;
+  CellMembrane::Side side;
+  U8 strength;
+  // As written; AntibodyStrength checks the range when the command runs.
+  U32 value;
+  // Thread count, deferred flag, Tissue::CellStorage, the id of the
+  // tissue a fork_ creates, or the number of seeds.
+  char const *text;
+  U32 textSize;
+  // Tissue name for tissueNew_ and fork_, the line for malformed_, the file
+  // for the snapshot and image commands, the seeds as written for
+  // infectionStartLocationsIs_.  Points into the input; not null-terminated.
+  char const *source;
+  U32 sourceSize;
+  // The text line the command was compiled from, if any.
+  Simulation::Ptr *simulation;
+  // The slot tissueNew binds for this tissue; set by CommandProgram.
+};
+
+static const char commandMagic[4] = {'H', 'I', 'V', 'C'};
+static const U32 commandVersion = 1;
+
+// Interned tissue names.
+class CommandTissues {
+public:
+  CommandTissues() : last_(0) {}
+
+  U32 tissues() const { return name_.size(); }
+  Fwk::String name(U16 id) const { return name_[id]; }
+
+  U16 tissueId(char const *name, U32 size);
+  // Throws if the name has not been interned.
+  U16 tissueIdNew(char const *name, U32 size);
+  // Interns name, or returns its existing id.
+
+private:
+  typedef std::map<Fwk::String, U16> IdMap;
+  IdMap id_;
+  std::vector<Fwk::String> name_;
+  U16 last_;
+  // Commands usually name the tissue of the command before.
+};
+
+// Text form.
+class CommandParser {
+public:
+  CommandParser(CommandTissues *tissues) : tissues_(tissues) {}
+
+  bool commandIs(char const *begin, char const *end, Command &cmd);
+  // Parses one line.  Returns false for a blank line or comment and
+  // throws if the line is malformed.
+
+private:
+  CommandTissues *tissues_;
+};
+
+// Binary form.
+void commandHeaderWrite(std::vector<char> &out);
+void commandWrite(Command const &cmd, std::vector<char> &out);
+
+bool commandBinary(char const *begin, char const *end);
+// True if the data starts with the binary header.
+char const *commandRead(char const *next, char const *end, Command &cmd);
+// Decodes the record at next and returns the one after it.  Throws if the
+// record is truncated or the opcode is unknown.
+
+Fwk::String commandText(Command const &cmd, CommandTissues const &tissues);
+// The command as a canonical text line.
+
+class CommandProgram {
+public:
+  CommandProgram() : statsSink_(StatsSink::standardOut()) {}
+
+  U32 commands() const { return command_.size(); }
+  Command const &command(U32 i) const { return command_[i]; }
+  CommandTissues const &tissues() const { return tissues_; }
+
+  void textCompile(char const *begin, char const *end);
+  // Appends the commands of a text rules file; lines that do not parse
+  // become malformed_ commands.
+  void binaryCompile(char const *begin, char const *end);
+  // Appends the commands of a binary rules file, header included.  Throws
+  // if the data is corrupt.
+  // Commands point into the input, which must outlive the program.
+
+  StatsSink::Ptr statsSink() const { return statsSink_; }
+  void statsSinkIs(StatsSink::Ptr _sink) { statsSink_ = _sink; }
+  // Where every simulation of the program writes its stats.
+
+  void run(U32 threads = 1);
+  // Runs every command in order against new simulations, reporting each
+  // failed command on cerr.  Notifications a tissue deferred are delivered
+  // after each command.  The stats sink is flushed before each failure is
+  // reported and at the end.  May be called again to replay the program.
+  // With more than one thread, tissues are run side by side, each by one
+  // worker in its own command order; their output is buffered and written
+  // in script order once all are done, so it matches a serial run.
+  // Programs with snapshot, image or fork commands always run serially.
+
+private:
+  CommandProgram(CommandProgram const &);
+  void operator=(CommandProgram const &);
+  // Not copyable: compiled commands point into simulation_.
+
+  struct TissueStream;
+  struct TissueStreams;
+  static void *tissueStreamsRun(void *arg);
+  void tissueStreamRun(TissueStream &stream);
+  void commandFailed(Command const &cmd);
+  void commandRun(Command const &cmd, StatsSink::Ptr statsSink);
+  void simulationsLinked();
+  CommandTissues tissues_;
+  std::vector<Command> command_;
+  std::vector<Simulation::Ptr> simulation_;
+  StatsSink::Ptr statsSink_;
+};
+
+#endif
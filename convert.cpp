@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include "command.h"
+
+/*
+  Converts a text rules file to the binary form main reads directly:
+    asgn1convert rules.log rules.bin
+  Lines that do not parse are carried over as they are, so running the
+  binary form reports the same errors.
+*/
+
+int main(int argc, const char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <rules> <binary rules>\n", argv[0]);
+    return 2;
+  }
+  Fwk::MappedFile::Ptr infile;
+  try {
+    infile = Fwk::MappedFile::MappedFileNew(argv[1]);
+  }
+  catch (...) {
+    fprintf(stderr, "error reading %s\n", argv[1]);
+    return 1;
+  }
+
+  CommandProgram program;
+  program.textCompile(infile->data(), infile->data() + infile->size());
+  vector<char> out;
+  commandHeaderWrite(out);
+  U32 malformed = 0;
+  for (U32 i = 0; i < program.commands(); i++) {
+    commandWrite(program.command(i), out);
+    if (program.command(i).op == Command::malformed_)
+      malformed++;
+  }
+
+  FILE *f = fopen(argv[2], "wb");
+  if (!f || fwrite(&out[0], 1, out.size(), f) != out.size() || fclose(f)) {
+    fprintf(stderr, "error writing %s\n", argv[2]);
+    return 1;
+  }
+  fprintf(stderr, "%u commands (%u malformed), %u tissues, %lu bytes\n",
+          program.commands(), malformed, program.tissues().tissues(),
+          (unsigned long) out.size());
+  return 0;
+}
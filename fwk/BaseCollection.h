@@ -75,8 +75,8 @@ public:
 
 inline void _newRef( void const volatile *  t ) {}
 inline void _deleteRef( void const volatile *  t ) {}
-template<class T> inline void _newRef( PtrInterface<T> const *  t ) { t->newRef(); }
-template<class T> inline void _deleteRef( PtrInterface<T> const *  t ) { t->deleteRef(); }
+template<class T, class R> inline void _newRef( PtrInterface<T,R> const *  t ) { t->newRef(); }
+template<class T, class R> inline void _deleteRef( PtrInterface<T,R> const *  t ) { t->deleteRef(); }
 // _newRef and _deleteRef update the refcount for PtrInterface types,
 // and do nothing for other types.  NOTE: these declarations are a
 // little bit fragile.  They are carefully designed, taking into
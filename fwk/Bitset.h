@@ -0,0 +1,55 @@
+// <h2>Fwk::Bitset</h2>
+//
+// Resizable set of small integers stored one bit each in 64-bit words.
+// The number of set bits is maintained as bits change, so members() is
+// constant time.  Scans go a word at a time through word() and the
+// standard bit tricks; bits past size() are always clear.
+// There is no concurrency control provided.
+
+#ifndef FWK_BITSET_H
+#define FWK_BITSET_H
+
+#include <vector>
+#include "Types.h"
+
+namespace Fwk {
+
+class Bitset {
+ public:
+   Bitset() : size_(0), members_(0) {}
+
+   U32 size() const { return size_; }
+   U32 members() const { return members_; }
+   U32 words() const { return word_.size(); }
+   U64 word( U32 w ) const { return word_[w]; }
+
+   bool bit( U32 i ) const { return ( word_[i >> 6] >> ( i & 63 ) ) & 1; }
+   void bitIs( U32 i, bool _bit ) {
+      U64 & w = word_[i >> 6];
+      U64 m = U64(1) << ( i & 63 );
+      if( _bit == bool( w & m ) ) return;
+      if( _bit ) {
+         w |= m;
+         ++members_;
+      } else {
+         w &= ~m;
+         --members_;
+      }
+   }
+
+   void sizeIs( U32 _size ) {
+      for( U32 i = _size; i < size_; ++i ) bitIs( i, false );
+      word_.resize( ( _size + 63 ) >> 6, 0 );
+      size_ = _size;
+   }
+   // Bits at or beyond the new size are cleared.
+
+ private:
+   U32 size_;
+   U32 members_;
+   std::vector<U64> word_;
+};
+
+}
+
+#endif
@@ -0,0 +1,311 @@
+// <h2>Fwk::ChunkGrid</h2>
+//
+// Map of 3D integer keys to pointers to objects that support smart
+// pointers, stored as a sparse set of cubic chunks.  Each chunk is a flat
+// array of (1<<bits)^3 slots indexed by the key's offset inside the chunk.
+// A chunk is allocated the first time a member falls inside it and freed
+// when its last member is deleted.
+// The Key type must have int x, y and z members and support hash(),
+// operator== and operator< so that it can also key the chunk directory,
+// which is a Fwk::HashMap of chunks keyed on their origin.
+// T must provide fwkKey(), fwkPtr() and fwkValue() as for HashMap, but
+// needs no fwkHmNext attribute.
+//
+// Members of one chunk are adjacent in memory, so looking up a neighbor
+// of a key that stays inside the same chunk is a constant slot offset.
+// The most recently used chunk is cached, which makes runs of lookups in
+// the same region cost no hashing at all.
+//
+// Iteration visits chunks in allocation order and, inside a chunk, the
+// slots in memory order.  Deleting the last member of a chunk moves the
+// most recently allocated chunk into its place in that order, so an
+// outstanding iterator may skip or revisit members after a delete; the
+// version attribute tells when that might have happened.
+// There is no concurrency control provided.  Lookups update the chunk
+// cache, so even const access must not be shared between threads.
+
+#ifndef FWK_CHUNKGRID_H
+#define FWK_CHUNKGRID_H
+
+#include <vector>
+#include "BaseCollection.h"
+#include "HashMap.h"
+
+namespace Fwk {
+
+template< typename T, typename Key, typename P = T,
+          typename Vconst = P, typename V = Vconst, int bits = 4 >
+class ChunkGrid : public BaseRefCollection<T> {
+ public:
+   typedef ChunkGrid<T,Key,P,Vconst,V,bits> Self;
+   enum {
+      edge = 1 << bits,
+      mask = edge - 1,
+      slots = edge * edge * edge,
+      words = (slots + 63) / 64
+   };
+
+   class Chunk : public PtrInterface<Chunk> {
+    public:
+      typedef Fwk::Ptr<Chunk const> PtrConst;
+      typedef Fwk::Ptr<Chunk> Ptr;
+      Key fwkKey() const { return origin_; }
+      Chunk const * fwkHmNext() const { return fwkHmNext_.ptr(); }
+      Chunk * fwkHmNext() { return fwkHmNext_.ptr(); }
+      void fwkHmNextIs( Chunk * _fwkHmNext ) const { fwkHmNext_ = _fwkHmNext; }
+      Chunk const * fwkPtr() const { return this; }
+      Chunk * fwkPtr() { return this; }
+      U32 members() const { return members_; }
+      U32 index() const { return index_; }
+      T * slot( U32 i ) const { return slot_[i].ptr(); }
+      S32 slotNext( U32 i ) const {
+         // Index of the first occupied slot at or after i, -1 if none.
+         for( U32 w = i >> 6; w < words; ++w ) {
+            U64 bitmap = occupied_[w];
+            if( w == (i >> 6) ) bitmap &= ~U64(0) << (i & 63);
+            if( bitmap ) return (w << 6) + __builtin_ctzll( bitmap );
+         }
+         return -1;
+      }
+    protected:
+      friend class ChunkGrid<T,Key,P,Vconst,V,bits>;
+      Chunk( Key const & _origin, U32 _index ) :
+            origin_(_origin), members_(0), index_(_index) {
+         memset( occupied_, 0, sizeof(occupied_) );
+      }
+      Key origin_;
+      U32 members_;
+      U32 index_;
+      mutable Fwk::Ptr<Chunk> fwkHmNext_;
+      U64 occupied_[ words ];
+      Fwk::Ptr<T> slot_[ slots ];
+   };
+   typedef HashMap< Chunk, Key > ChunkMap;
+
+   ChunkGrid() : version_(1), members_(0), lastChunk_(0) {}
+   virtual ~ChunkGrid() { memberDelAll(); }
+
+   U32 members() const { return members_; }
+   U32 version() const { return version_; }
+   U32 chunks() const { return chunkVec_.size(); }
+   Chunk * chunk( U32 i ) const { return chunkVec_[i]; }
+
+   static Key origin( Key const & k ) {
+      Key o = k;
+      o.x &= ~int(mask);
+      o.y &= ~int(mask);
+      o.z &= ~int(mask);
+      return o;
+   }
+   static U32 offset( Key const & k ) {
+      return (k.x & mask) | ((k.y & mask) << bits) | ((k.z & mask) << (2*bits));
+   }
+
+   Chunk * chunk( Key const & k ) const {
+      Key o = origin( k );
+      Chunk * c = lastChunk_;
+      if( c && c->origin_ == o ) return c;
+      c = const_cast<ChunkMap &>( chunk_ )[o];
+      if( c ) lastChunk_ = c;
+      return c;
+   }
+   // Chunk containing k, or null if none has been allocated.
+
+   T const * operator[]( Key const & k ) const {
+      Chunk * c = chunk( k );
+      return c ? c->slot_[ offset( k ) ].ptr() : 0;
+   }
+   T * operator[]( Key const & k ) {
+      Chunk * c = chunk( k );
+      return c ? c->slot_[ offset( k ) ].ptr() : 0;
+   }
+   T * member( Key const & k ) { return operator[](k); }
+
+   T * neighbor( Key const & k, int dx, int dy, int dz ) {
+      U32 lx = (k.x & mask) + dx;
+      U32 ly = (k.y & mask) + dy;
+      U32 lz = (k.z & mask) + dz;
+      if( lx < U32(edge) && ly < U32(edge) && lz < U32(edge) ) {
+         Chunk * c = chunk( k );
+         if( !c ) return 0;
+         return c->slot_[ offset( k ) + dx + dy * edge + dz * edge * edge ].ptr();
+      }
+      Key n = k;
+      n.x += dx;
+      n.y += dy;
+      n.z += dz;
+      return operator[](n);
+   }
+   // Member at k shifted by (dx,dy,dz), each in [-1,1].  Stays inside k's
+   // chunk whenever possible.
+
+   void newMember( T * t ) {
+      Key k = t->fwkKey();
+      Chunk * c = chunk( k );
+      if( !c ) c = chunkNew( origin( k ) );
+      U32 i = offset( k );
+      assert( !c->slot_[i] );
+      c->slot_[i] = t;
+      c->occupied_[i >> 6] |= U64(1) << (i & 63);
+      ++c->members_;
+      ++members_;
+      ++version_;
+   }
+   void newMember( const Ptr<T>& t ) { newMember( t.ptr() ); }
+   // Insert t at its key.  This does not check for a member already present.
+
+   Ptr<T> memberDel( Key const & k ) {
+      Chunk * c = chunk( k );
+      if( !c ) return 0;
+      U32 i = offset( k );
+      Ptr<T> ret = c->slot_[i];
+      if( !ret ) return 0;
+      c->slot_[i] = 0;
+      c->occupied_[i >> 6] &= ~(U64(1) << (i & 63));
+      --c->members_;
+      --members_;
+      ++version_;
+      if( !c->members_ ) chunkDel( c );
+      return ret;
+   }
+   Ptr<T> deleteMember( Key const & k ) { return memberDel( k ); }
+   Ptr<T> memberUnlink( Key const & k ) { return memberDel( k ); }
+   void bucketsFit() {}
+   // Counterparts of the HashMap bulk-deletion calls; a grid never resizes.
+
+   void memberDelAll() {
+      for( U32 i = 0; i < chunkVec_.size(); ++i ) {
+         Chunk * c = chunkVec_[i];
+         for( U32 s = 0; s < U32(slots); ++s ) c->slot_[s] = 0;
+      }
+      chunkVec_.clear();
+      lastChunk_ = 0;
+      chunk_.memberDelAll();
+      members_ = 0;
+      ++version_;
+   }
+
+   class IteratorConst : public BaseIteratorConst<T> {
+    public:
+      IteratorConst() : BaseIteratorConst<T>( 0, 0 ) { data0_ = data1_ = 0; }
+      IteratorConst const & operator++() {
+         advance();
+         return *this;
+      }
+      Vconst operator*() const { return _ptr()->fwkValue(); }
+      P const * operator->() const { return _ptr()->fwkPtr(); }
+      P const * ptr() const { return _ptr()->fwkPtr(); }
+      Key key() const { return _ptr()->fwkKey(); }
+    protected:
+      friend class ChunkGrid<T,Key,P,Vconst,V,bits>;
+      using BaseIteratorConst<T>::collection_;
+      using BaseIteratorConst<T>::data0_;
+      using BaseIteratorConst<T>::data1_;
+      IteratorConst( Self const * g, T const * t, U32 chunk, U32 slot ) :
+            BaseIteratorConst<T>( g, t ) {
+         data1_ = chunk;
+         data0_ = slot;
+      }
+      T const * _ptr() const { return BaseIteratorConst<T>::ptr(); }
+      Self const * grid() const { return static_cast<Self const *>( collection_ ); }
+      void advance() {
+         U32 ci = data1_;
+         U32 si = data0_ + 1;
+         this->ptrIs( grid()->findNext( &ci, &si ) );
+         data1_ = ci;
+         data0_ = si;
+      }
+   };
+
+   IteratorConst iterator() const {
+      U32 ci = 0, si = 0;
+      T * t = findNext( &ci, &si );
+      return IteratorConst( this, t, ci, si );
+   }
+   IteratorConst iterator( Key const & k ) const {
+      Chunk * c = chunk( k );
+      T * t = c ? c->slot_[ offset( k ) ].ptr() : 0;
+      return IteratorConst( this, t, c ? c->index_ : 0, offset( k ) );
+   }
+   // Position at member with key k, or end if none.
+
+   class Iterator : public IteratorConst {
+    public:
+      Iterator() {}
+      P * ptr() const { return const_cast< P * >( _ptr()->fwkPtr() ); }
+      P * operator->() const { return const_cast< P * >( _ptr()->fwkPtr() ); }
+      V operator*() const { return _ptr()->fwkValue(); }
+      Iterator & operator++() {
+         IteratorConst::advance();
+         return *this;
+      }
+    protected:
+      friend class ChunkGrid<T,Key,P,Vconst,V,bits>;
+      Iterator( IteratorConst const & i ) : IteratorConst( i ) {}
+      T * _ptr() const { return const_cast< T * >( BaseIteratorConst<T>::ptr() ); }
+   };
+
+   Iterator iterator() {
+      return Iterator( const_cast<Self const *>(this)->iterator() );
+   }
+   Iterator iterator( Key const & k ) {
+      return Iterator( const_cast<Self const *>(this)->iterator( k ) );
+   }
+
+ protected:
+   T * findNext( U32 * ci, U32 * si ) const {
+      for( ; *ci < chunkVec_.size(); ++*ci, *si = 0 ) {
+         if( *si >= U32(slots) ) continue;
+         Chunk * c = chunkVec_[ *ci ];
+         S32 s = c->slotNext( *si );
+         if( s >= 0 ) {
+            *si = s;
+            return c->slot_[s].ptr();
+         }
+      }
+      return 0;
+   }
+   // Advance (*ci,*si) to the first occupied slot at or after it.
+
+   Chunk * chunkNew( Key const & o ) {
+      Chunk * c = new Chunk( o, chunkVec_.size() );
+      chunk_.newMember( c );
+      c->referencesDec( 1 );
+      chunkVec_.push_back( c );
+      lastChunk_ = c;
+      return c;
+   }
+   void chunkDel( Chunk * c ) {
+      if( lastChunk_ == c ) lastChunk_ = 0;
+      Chunk * last = chunkVec_.back();
+      chunkVec_[ c->index_ ] = last;
+      last->index_ = c->index_;
+      chunkVec_.pop_back();
+      chunk_.memberDel( c->origin_ );
+   }
+
+ private:
+   typedef BaseCollection::StrepIterator StrepIterator;
+   virtual bool iteratorMoreLeft( StrepIterator const & bi ) const {
+      IteratorConst const * tmp = static_cast<IteratorConst const *>( &bi );
+      return *tmp;
+   }
+   virtual void iteratorIncr( StrepIterator& bi ) const {
+      IteratorConst * tmp = static_cast<IteratorConst *>( &bi );
+      ++(*tmp);
+   }
+   virtual String iteratorStrep( StrepIterator const & bi ) const {
+      IteratorConst const * tmp = static_cast<IteratorConst const *>( &bi );
+      return valueToStrep( tmp->key() );
+   }
+
+   U32 version_;
+   U32 members_;
+   ChunkMap chunk_;
+   std::vector<Chunk *> chunkVec_; // allocation order, owned through chunk_
+   mutable Chunk * lastChunk_;
+};
+
+}
+
+#endif
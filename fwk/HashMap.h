@@ -110,9 +110,10 @@ class HashMap : public BaseRefCollection<T> {
    HashMap( U32 _buckets=bkts) : version_(1), members_(0) {
       if( _buckets ) {
          buckets_ = (_buckets == 1) ? 1 : nlpo2( _buckets - 1 ); // round up to power of two
-         bucket_ = (Ptr<T> *)
-            new U8[ buckets_ * sizeof(Ptr<T>) ];
-         memset( bucket_, 0, buckets_ * sizeof(Ptr<T>) );
+         // Cleared as raw memory, as in bucketsIs; a null Ptr is all zeros.
+         U8 * mem = new U8[ buckets_ * sizeof(Ptr<T>) ];
+         memset( mem, 0, buckets_ * sizeof(Ptr<T>) );
+         bucket_ = reinterpret_cast<Ptr<T> *>( mem );
       }
       else {
          buckets_ = 0;
@@ -300,6 +301,11 @@ class HashMap : public BaseRefCollection<T> {
    // Delete t if in the hash table, i.e. make it not an member if it is.
 
    Ptr<T> memberDel( Key k ) {
+      Ptr<T> ret = memberUnlink( k );
+      if( ret ) maybeShrink();
+      return ret;
+   }
+   Ptr<T> memberUnlink( Key k ) {
       U32 i = bucket( hash( k ));
       T * prev = 0;
       for( T * c = bucket_[i].ptr(); c; c = c->fwkHmNext() ) {
@@ -314,13 +320,16 @@ class HashMap : public BaseRefCollection<T> {
             --members_;
             ++version_;
             c->fwkHmNextIs( 0 );
-            maybeShrink();
             return ret;
          }
          prev = c;
       }
       return 0;
    }
+   // As memberDel, but the table is not resized.  For deleting many members
+   // at once; call bucketsFit afterwards.
+   void bucketsFit() { maybeShrink(); }
+   // Shrink the table, if warranted, to suit the current membership.
    Ptr<T> deleteMember( Key k ) {
       return memberDel(k);
    }
@@ -71,7 +71,7 @@ class LinkedQueue : public BaseRefCollection<T> {
    Ptr<T> headDel() {
       Ptr<T> ptr = head_.ptr();
       if( ptr ) {
-  	 if( tail_ == ptr ) tail_ = 0;
+  	 if( tail_ == ptr.ptr() ) tail_ = 0;
          head_ = ptr->lqNext();
          ptr->lqNextIs(0);
          ++version_;
@@ -139,7 +139,7 @@ class LinkedQueue : public BaseRefCollection<T> {
       }
       IteratorConst& operator++() {
          const T * c = _ptr();
-         ptrIs( c->lqNext() );
+         this->ptrIs( c->lqNext() );
          return *this;
       }
       Self * list() const {
@@ -190,7 +190,7 @@ class LinkedQueue : public BaseRefCollection<T> {
       Iterator& operator++() {
          T * c = _ptr();
          prev_ = c;
-         ptrIs( c->lqNext() );
+         this->ptrIs( c->lqNext() );
          return *this;
       }
       void newPtr( T * newMember ) {
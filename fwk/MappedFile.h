@@ -0,0 +1,77 @@
+// <h2>Fwk::MappedFile</h2>
+//
+// Read-only view of a whole file, mapped into memory rather than read.
+// data() points at size() bytes that stay valid, and are never copied,
+// for as long as the MappedFile is referenced.  The contents are not
+// null-terminated.  An empty file has a null data().
+// MappedFileNew throws ErrnoException if the file cannot be opened or
+// mapped.
+// There is no concurrency control provided, beyond an atomic reference
+// count: forks of a tissue image on different threads share its file.
+
+#ifndef FWK_MAPPEDFILE_H
+#define FWK_MAPPEDFILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Exception.h"
+#include "Ptr.h"
+#include "PtrInterface.h"
+
+namespace Fwk {
+
+class MappedFile : public PtrInterface<MappedFile, AtomicReferences> {
+ public:
+   typedef Fwk::Ptr<MappedFile const> PtrConst;
+   typedef Fwk::Ptr<MappedFile> Ptr;
+
+   char const * data() const { return data_; }
+   size_t size() const { return size_; }
+   String path() const { return path_; }
+
+   static MappedFile::Ptr MappedFileNew( String _path ) {
+      Ptr m = new MappedFile( _path );
+      m->referencesDec(1);
+      // decr. refer count to compensate for initial val of 1
+      return m;
+   }
+
+ protected:
+   MappedFile( const MappedFile& );
+   MappedFile( String _path ) : path_(_path), data_(0), size_(0) {
+      int fd = ::open( _path.c_str(), O_RDONLY );
+      if( fd < 0 ) throw ErrnoException( errno, _path );
+      struct stat st;
+      if( ::fstat( fd, &st ) < 0 ) {
+         int e = errno;
+         ::close( fd );
+         throw ErrnoException( e, _path );
+      }
+      size_ = st.st_size;
+      if( size_ ) {
+         void * p = ::mmap( 0, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+         if( p == MAP_FAILED ) {
+            int e = errno;
+            ::close( fd );
+            throw ErrnoException( e, _path );
+         }
+         ::madvise( p, size_, MADV_SEQUENTIAL );
+         data_ = static_cast<char const *>( p );
+      }
+      ::close( fd );
+   }
+   ~MappedFile() {
+      if( data_ ) ::munmap( const_cast<char *>( data_ ), size_ );
+   }
+
+   String path_;
+   char const * data_;
+   size_t size_;
+};
+
+}
+
+#endif
@@ -0,0 +1,59 @@
+// <h2>Fwk::NotificationQueue</h2>
+//
+// Queue of notifiees with notifications pending, for deferred delivery.
+// A notifier records what changed in the notifiee itself and then calls
+// notifieeNew; the notifiee goes on the queue, linked through lqNext, only
+// if it is not already there, so repeated changes before a dispatch are
+// merged into one delivery.  While queued, a notifiee's
+// notificationAttribute is the attribute that changed, or
+// multipleAttributes__ if there was more than one, and nullNotification_
+// otherwise.
+//
+// dispatch drains the queue, calling onNotification on each notifiee in
+// the order first queued.  Notifiees queued during the dispatch are
+// delivered by the same call.  An exception from onNotification is passed
+// to the notifiee's onNotificationException.
+// There is no concurrency control provided.
+
+#ifndef FWK_NOTIFICATIONQUEUE_H
+#define FWK_NOTIFICATIONQUEUE_H
+
+#include "BaseNotifiee.h"
+#include "LinkedQueue.h"
+
+namespace Fwk {
+
+inline String valueToStrep( RootNotifiee * _n ) { return _n->name(); }
+
+class NotificationQueue {
+ public:
+   U32 notifiees() const { return queue_.members(); }
+
+   void notifieeNew( RootNotifiee * _n, RootNotifiee::AttributeId _aid ) {
+      RootNotifiee::AttributeId pending = _n->notificationAttribute();
+      if( pending == RootNotifiee::nullNotification_ ) {
+         _n->notificationAttribute( _aid );
+         queue_.newMember( _n );
+      } else if( pending != _aid ) {
+         _n->notificationAttribute( RootNotifiee::multipleAttributes__ );
+      }
+   }
+
+   void dispatch() {
+      while( queue_.head() ) {
+         RootNotifiee::Ptr n = queue_.headDel();
+         RootNotifiee::AttributeId aid = n->notificationAttribute();
+         n->notificationAttribute( RootNotifiee::nullNotification_ );
+         try {
+            n->onNotification();
+         } catch(...) { n->onNotificationException( aid ); }
+      }
+   }
+
+ private:
+   LinkedQueue<RootNotifiee> queue_;
+};
+
+}
+
+#endif
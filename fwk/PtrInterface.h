@@ -8,13 +8,44 @@
 
 namespace Fwk {
 
-template <class T>
+// Reference count policies.  SerialReferences is a plain count, for objects
+// referenced from one thread at a time.  AtomicReferences may be taken and
+// dropped on several threads at once, for a locked instruction per change:
+// an increment needs no ordering, and a decrement is acquire-release so
+// that the thread that deletes the object sees what the others wrote to it.
+// DefaultReferences is SerialReferences unless the build defines
+// FWK_ATOMIC_REFERENCES.
+struct SerialReferences {
+    static long unsigned value( long unsigned const & r ) { return r; }
+    static void inc( long unsigned & r ) { ++r; }
+    static bool dec( long unsigned & r, U32 d ) { return ( r -= d ) == 0; }
+};
+
+struct AtomicReferences {
+    static long unsigned value( long unsigned const & r ) {
+        return __atomic_load_n( &r, __ATOMIC_RELAXED );
+    }
+    static void inc( long unsigned & r ) {
+        __atomic_fetch_add( &r, 1, __ATOMIC_RELAXED );
+    }
+    static bool dec( long unsigned & r, U32 d ) {
+        return __atomic_sub_fetch( &r, d, __ATOMIC_ACQ_REL ) == 0;
+    }
+};
+
+#ifdef FWK_ATOMIC_REFERENCES
+typedef AtomicReferences DefaultReferences;
+#else
+typedef SerialReferences DefaultReferences;
+#endif
+
+template <class T, class References = DefaultReferences>
 class PtrInterface {
 private:
     long unsigned ref_;
 public:
     PtrInterface() : ref_(1) {}
-    unsigned long references() const { return ref_; }
+    unsigned long references() const { return References::value( ref_ ); }
     enum Attribute {
       nextAttributeNumber__ = 1
     };
@@ -28,23 +59,23 @@ protected:
     virtual void onZeroReferences() { delete this; }
 };
 
-template<class T> const PtrInterface<T> * 
-PtrInterface<T>::newRef() const { 
+template<class T, class R> const PtrInterface<T,R> * 
+PtrInterface<T,R>::newRef() const { 
     PtrInterface *me = const_cast<PtrInterface *>( this );
-    ++me->ref_;
+    R::inc( me->ref_ );
     return this;
 }
 
-template<class T> void 
-PtrInterface<T>::deleteRef() const {
+template<class T, class R> void 
+PtrInterface<T,R>::deleteRef() const {
     PtrInterface *me = const_cast<PtrInterface *>( this );
-    if( --me->ref_ == 0 ) me->onZeroReferences();
+    if( R::dec( me->ref_, 1 ) ) me->onZeroReferences();
 }
 
-template<class T> void 
-PtrInterface<T>::referencesDec( U32 dec ) const {
+template<class T, class R> void 
+PtrInterface<T,R>::referencesDec( U32 dec ) const {
     PtrInterface *me = const_cast<PtrInterface *>( this );
-    if((me->ref_-=dec) == 0 ) me->onZeroReferences();
+    if( R::dec( me->ref_, dec ) ) me->onZeroReferences();
 }
 
 }
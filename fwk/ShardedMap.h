@@ -0,0 +1,219 @@
+// <h2>Fwk::ShardedMap</h2>
+//
+// Map of 3D integer keys to pointers to objects that support smart
+// pointers, split into a fixed number of shards, each a Fwk::HashMap with
+// a lock of its own.  Space is cut into slabs (1<<bits) keys wide along x,
+// and slabs are dealt to the shards in turn, so a key's shard depends on
+// its x alone and two keys that differ by one in y or z are always in the
+// same shard.  The Key type must have an int x member and meet the
+// HashMap requirements; T must meet them too, fwkHmNext included.
+//
+// The map does no locking of its own.  A client that changes it from
+// several threads holds the lock of each shard it touches, through lock
+// and unlock or through neighborhoodLock, which takes the shards of a key
+// and of its two neighbors along x in shard order so that two threads
+// never wait on each other.  Members, lookups and iteration are otherwise
+// as for a HashMap: a client must not iterate while the map is changed.
+//
+// Iteration visits the shards in order and each shard in HashMap order.
+
+#ifndef FWK_SHARDEDMAP_H
+#define FWK_SHARDEDMAP_H
+
+#include <pthread.h>
+#include "BaseCollection.h"
+#include "HashMap.h"
+
+namespace Fwk {
+
+template< typename T, typename Key, typename P = T,
+          typename Vconst = P, typename V = Vconst,
+          int shardCount = 16, int bits = 4 >
+class ShardedMap : public BaseRefCollection<T> {
+ public:
+   typedef ShardedMap<T,Key,P,Vconst,V,shardCount,bits> Self;
+   enum {
+      shards = shardCount,
+      slabWidth = 1 << bits
+   };
+
+   class Shard : public HashMap<T,Key,P,Vconst,V> {
+    public:
+      T * next( T const * t ) const {
+         T * n = t ? const_cast<T *>( t )->fwkHmNext() : 0;
+         S32 bkt;
+         return n ? n : this->findNext( t, &bkt );
+      }
+      // Member after t in iteration order, or after where t was if it has
+      // been deleted; t null gives the first.
+   };
+
+   ShardedMap() {
+      for( U32 i = 0; i < U32(shards); ++i ) pthread_mutex_init( &lock_[i], 0 );
+   }
+   virtual ~ShardedMap() {
+      for( U32 i = 0; i < U32(shards); ++i ) pthread_mutex_destroy( &lock_[i] );
+   }
+
+   static U32 shard( Key const & k ) {
+      return ( U32( k.x ) >> bits ) & ( shards - 1 );
+   }
+   Shard const & shardMap( U32 i ) const { return shard_[i]; }
+   Shard & shardMap( U32 i ) { return shard_[i]; }
+
+   U32 members() const {
+      U32 n = 0;
+      for( U32 i = 0; i < U32(shards); ++i ) n += shard_[i].members();
+      return n;
+   }
+   U32 version() const {
+      U32 n = 0;
+      for( U32 i = 0; i < U32(shards); ++i ) n += shard_[i].version();
+      return n;
+   }
+   // Sums over the shards; version still changes with every change.
+
+   void lock( U32 i ) const { pthread_mutex_lock( &lock_[i] ); }
+   void unlock( U32 i ) const { pthread_mutex_unlock( &lock_[i] ); }
+   void neighborhoodLock( Key const & k ) const {
+      U32 s[3];
+      U32 n = neighborhood( k, s );
+      for( U32 i = 0; i < n; ++i ) lock( s[i] );
+   }
+   void neighborhoodUnlock( Key const & k ) const {
+      U32 s[3];
+      U32 n = neighborhood( k, s );
+      while( n ) unlock( s[--n] );
+   }
+   // Locks the shards holding k and the keys next to it, which are all the
+   // shards a change at k needs to look at.
+
+   T const * operator[]( Key const & k ) const { return shard_[shard( k )][k]; }
+   T * operator[]( Key const & k ) { return shard_[shard( k )][k]; }
+
+   void newMember( T * t ) { shard_[shard( t->fwkKey() )].newMember( t ); }
+   void newMember( const Ptr<T>& t ) { newMember( t.ptr() ); }
+   Ptr<T> deleteMember( Key const & k ) { return shard_[shard( k )].memberDel( k ); }
+   Ptr<T> memberUnlink( Key const & k ) { return shard_[shard( k )].memberUnlink( k ); }
+   void bucketsFit() {
+      for( U32 i = 0; i < U32(shards); ++i ) shard_[i].bucketsFit();
+   }
+   void bucketsIs( U32 b ) {
+      for( U32 i = 0; i < U32(shards); ++i ) shard_[i].bucketsIs( b );
+   }
+   // Buckets per shard.
+
+   class IteratorConst : public BaseIteratorConst<T> {
+    public:
+      IteratorConst() : BaseIteratorConst<T>( 0, 0 ) { data0_ = data1_ = 0; }
+      IteratorConst const & operator++() {
+         advance();
+         return *this;
+      }
+      Vconst operator*() const { return _ptr()->fwkValue(); }
+      P const * operator->() const { return _ptr()->fwkPtr(); }
+      P const * ptr() const { return _ptr()->fwkPtr(); }
+      Key key() const { return _ptr()->fwkKey(); }
+    protected:
+      friend class ShardedMap<T,Key,P,Vconst,V,shardCount,bits>;
+      using BaseIteratorConst<T>::collection_;
+      using BaseIteratorConst<T>::data0_;
+      using BaseIteratorConst<T>::data1_;
+      IteratorConst( Self const * m, T const * t, U32 s ) :
+            BaseIteratorConst<T>( m, t ) {
+         data0_ = s;
+         data1_ = 0;
+      }
+      T const * _ptr() const { return BaseIteratorConst<T>::ptr(); }
+      Self const * map() const { return static_cast<Self const *>( collection_ ); }
+      void advance() {
+         U32 s = data0_;
+         this->ptrIs( map()->findNext( &s, _ptr() ) );
+         data0_ = s;
+      }
+   };
+
+   IteratorConst iterator() const {
+      U32 s = 0;
+      T * t = findNext( &s, 0 );
+      return IteratorConst( this, t, s );
+   }
+   IteratorConst iterator( Key const & k ) const {
+      U32 s = shard( k );
+      return IteratorConst( this, shard_[s][k], s );
+   }
+   // Position at member with key k, or end if none.
+
+   class Iterator : public IteratorConst {
+    public:
+      Iterator() {}
+      P * ptr() const { return const_cast< P * >( _ptr()->fwkPtr() ); }
+      P * operator->() const { return const_cast< P * >( _ptr()->fwkPtr() ); }
+      V operator*() const { return _ptr()->fwkValue(); }
+      Iterator & operator++() {
+         IteratorConst::advance();
+         return *this;
+      }
+    protected:
+      friend class ShardedMap<T,Key,P,Vconst,V,shardCount,bits>;
+      Iterator( IteratorConst const & i ) : IteratorConst( i ) {}
+      T * _ptr() const { return const_cast< T * >( BaseIteratorConst<T>::ptr() ); }
+   };
+
+   Iterator iterator() {
+      return Iterator( const_cast<Self const *>(this)->iterator() );
+   }
+   Iterator iterator( Key const & k ) {
+      return Iterator( const_cast<Self const *>(this)->iterator( k ) );
+   }
+
+ protected:
+   U32 neighborhood( Key const & k, U32 * s ) const {
+      // With slabs at least two keys wide, only one neighbor of k can be
+      // in another shard, and no more than two shards are involved.
+      U32 own = shard( k );
+      Key n = k;
+      n.x = k.x - 1;
+      U32 other = shard( n );
+      if( other == own ) {
+         n.x = k.x + 1;
+         other = shard( n );
+      }
+      if( other == own ) {
+         s[0] = own;
+         return 1;
+      }
+      s[0] = own < other ? own : other;
+      s[1] = own < other ? other : own;
+      return 2;
+   }
+
+   T * findNext( U32 * s, T const * t ) const {
+      T * n = shard_[*s].next( t );
+      while( !n && ++*s < U32(shards) ) n = shard_[*s].next( 0 );
+      return n;
+   }
+   // Member after t, moving on to later shards; *s follows it.
+
+ private:
+   typedef BaseCollection::StrepIterator StrepIterator;
+   virtual bool iteratorMoreLeft( StrepIterator const & bi ) const {
+      IteratorConst const * tmp = static_cast<IteratorConst const *>( &bi );
+      return *tmp;
+   }
+   virtual void iteratorIncr( StrepIterator& bi ) const {
+      IteratorConst * tmp = static_cast<IteratorConst *>( &bi );
+      ++(*tmp);
+   }
+   virtual String iteratorStrep( StrepIterator const & bi ) const {
+      IteratorConst const * tmp = static_cast<IteratorConst const *>( &bi );
+      return valueToStrep( tmp->key() );
+   }
+
+   Shard shard_[ shards ];
+   mutable pthread_mutex_t lock_[ shards ];
+};
+
+}
+
+#endif
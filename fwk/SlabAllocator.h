@@ -0,0 +1,148 @@
+// <h2>Fwk::SlabAllocator</h2>
+//
+// Region allocator for small objects that are created and destroyed in
+// bursts.  Memory is taken from the heap in fixed-size slabs; each slab
+// serves a single size class (a multiple of 16 bytes) and freed objects go
+// on a per-class free list for reuse.  Slabs are only returned to the heap
+// in bulk, when the allocator itself is destroyed.
+//
+// Every object carries a 16-byte header naming the allocator it came from,
+// so an object may be deleted through an ordinary virtual destructor.  A
+// live object holds a reference to its allocator: the allocator and all of
+// its slabs go away once its owner has dropped it and the last object it
+// handed out has been deleted.  Objects too large for any size class, or
+// allocated with a null allocator, come straight from the global heap.
+//
+// Classes opt in by deriving from SlabAllocated and are then created with
+// "new (allocator) T(...)".
+// There is no concurrency control provided.
+
+#ifndef FWK_SLABALLOCATOR_H
+#define FWK_SLABALLOCATOR_H
+
+#include <new>
+#include <vector>
+#include "Ptr.h"
+#include "PtrInterface.h"
+
+namespace Fwk {
+
+class SlabAllocator : public PtrInterface<SlabAllocator> {
+ public:
+   typedef Fwk::Ptr<SlabAllocator const> PtrConst;
+   typedef Fwk::Ptr<SlabAllocator> Ptr;
+   enum {
+      grain = 16,
+      classes = 32,
+      slabBytes = 64 * 1024
+   };
+
+   U32 live() const { return live_; }
+   // Objects currently allocated and not yet deleted.
+   U32 slabs() const { return slab_.size(); }
+   U64 bytes() const { return U64( slab_.size() ) * slabBytes; }
+   // Heap memory held in slabs, whether in use or on a free list.
+
+   static SlabAllocator::Ptr SlabAllocatorNew() {
+      Ptr m = new SlabAllocator();
+      m->referencesDec(1);
+      // decr. refer count to compensate for initial val of 1
+      return m;
+   }
+
+   static void * objectNew( size_t _size, SlabAllocator * _allocator ) {
+      size_t sc = ( _size + sizeof(Header) + grain - 1 ) / grain;
+      Header * h;
+      if( _allocator && sc <= U32(classes) ) {
+         h = _allocator->chunkNew( sc - 1 );
+      } else {
+         h = static_cast<Header *>( ::operator new( _size + sizeof(Header) ) );
+         h->allocator = 0;
+      }
+      return h + 1;
+   }
+   static void objectDel( void * _p ) {
+      if( !_p ) return;
+      Header * h = static_cast<Header *>( _p ) - 1;
+      if( h->allocator ) h->allocator->chunkDel( h );
+      else ::operator delete( h );
+   }
+
+ protected:
+   struct Header {
+      SlabAllocator * allocator;
+      U32 sizeClass;
+      U32 pad;
+   };
+   struct FreeChunk {
+      FreeChunk * next;
+   };
+
+   SlabAllocator() : live_(0) {
+      for( U32 i = 0; i < U32(classes); ++i ) {
+         free_[i] = 0;
+         next_[i] = end_[i] = 0;
+      }
+   }
+   ~SlabAllocator() {
+      for( U32 i = 0; i < slab_.size(); ++i ) ::operator delete( slab_[i] );
+   }
+
+   Header * chunkNew( U32 _class ) {
+      size_t size = ( _class + 1 ) * grain;
+      char * p;
+      if( free_[_class] ) {
+         p = reinterpret_cast<char *>( free_[_class] );
+         free_[_class] = free_[_class]->next;
+      } else {
+         if( next_[_class] + size > end_[_class] ) {
+            char * slab = static_cast<char *>( ::operator new( slabBytes ) );
+            slab_.push_back( slab );
+            next_[_class] = slab;
+            end_[_class] = slab + slabBytes;
+         }
+         p = next_[_class];
+         next_[_class] += size;
+      }
+      Header * h = reinterpret_cast<Header *>( p );
+      h->allocator = this;
+      h->sizeClass = _class;
+      ++live_;
+      newRef();
+      return h;
+   }
+   void chunkDel( Header * _h ) {
+      U32 sc = _h->sizeClass;
+      FreeChunk * f = reinterpret_cast<FreeChunk *>( _h );
+      f->next = free_[sc];
+      free_[sc] = f;
+      --live_;
+      deleteRef();
+   }
+
+   U32 live_;
+   FreeChunk * free_[ classes ];
+   char * next_[ classes ];
+   char * end_[ classes ];
+   std::vector<char *> slab_;
+};
+
+class SlabAllocated {
+ public:
+   static void * operator new( size_t _size, SlabAllocator * _allocator ) {
+      return SlabAllocator::objectNew( _size, _allocator );
+   }
+   static void * operator new( size_t _size ) {
+      return SlabAllocator::objectNew( _size, 0 );
+   }
+   static void operator delete( void * _p, SlabAllocator * ) {
+      SlabAllocator::objectDel( _p );
+   }
+   static void operator delete( void * _p ) {
+      SlabAllocator::objectDel( _p );
+   }
+};
+
+}
+
+#endif
@@ -1,146 +1,99 @@
 #include <fstream>
 #include <stdlib.h>
+#include "command.h"
 #include "simulation.h"
+#include "stats.h"
 #include "Tissue.h"
 
 using namespace std;
-using namespace boost;
 
 /*
   The main takes in one input, the file name with the rules.
   The rules are then executed and the appropriate statistics are printed
-  to the console.
+  to the console.  The rules may be text or the binary form written by
+  asgn1convert; either is compiled in full before the first command runs.
+  An optional second input replays the compiled rules that many times,
+  for benchmarking.
+
+    asgn1 [-t threads] [-f text|csv|binary] [-o stats] [-i rounds]
+          rules [runs]
+
+  With -t, independent tissues run side by side on up to that many threads;
+  the output is the same as a serial run.  -f picks the format of the
+  stats, which go to the file given with -o or else to standard out; they
+  are buffered and flushed every -i rounds, before an error is reported,
+  and at the end.
 */
 
-Cell::Coordinates coordinateIs(
-  tokenizer<char_separator<char> >::iterator token)
-{
-  Cell::Coordinates loc;
-  loc.x = lexical_cast<S32>(*token++);
-  loc.y = lexical_cast<S32>(*token++);
-  loc.z = lexical_cast<S32>(*token);
-  return loc;
-}
-
-CellMembrane::Side sideIs(
-  tokenizer<char_separator<char> >::iterator token)
-{
-  if (*token == "north")
-    return CellMembrane::north_;
-
-  if (*token == "south")
-    return CellMembrane::south_;
-
-  if (*token == "east")
-    return CellMembrane::east_;
-
-  if (*token == "west")
-    return CellMembrane::west_;
-
-  if (*token == "up")
-    return CellMembrane::up_;
-
-  if (*token == "down")
-    return CellMembrane::down_;
-
-  throw "Unrecognized membrane side";
-}
-
-void commandIs(Fwk::String textLine, map<Fwk::String, Simulation::Ptr>& sims) 
-{
-  if (textLine == "" || textLine[0] == '#')
-    return;
-
-  char_separator<char> sep(" ");
-  tokenizer<char_separator<char> > tokenizedLine(textLine, sep);
-  tokenizer<char_separator<char> >::iterator token=tokenizedLine.begin(); 
+int main(int argc, const char* argv[]) {
+  ios::sync_with_stdio(false);
+
+  U32 threads = 1;
+  StatsSink::Format format = StatsSink::text();
+  const char *statsPath = 0;
+  U32 flushInterval = 0;
+  while (argc > 2 && argv[1][0] == '-') {
+    string option = argv[1];
+    string value = argv[2];
+    if (option == "-t")
+      threads = atoi(argv[2]);
+    else if (option == "-f" && value == "csv")
+      format = StatsSink::csv();
+    else if (option == "-f" && value == "binary")
+      format = StatsSink::binary();
+    else if (option == "-o")
+      statsPath = argv[2];
+    else if (option == "-i")
+      flushInterval = atoi(argv[2]);
+    else if (option != "-f" || value != "text")
+      break;
+    argc -= 2;
+    argv += 2;
+  }
 
-  if (*token == "Tissue") {
-    token++;
-    if (*token == "tissueNew") {
-      token++;
-      Simulation::Ptr curSim = Simulation::SimulationNew(*token);
-      sims[*token] = curSim;
-    } else {
-      Simulation::Ptr curSim = sims[*token];
-      token++;
-      if (*token == "cytotoxicCellNew") {
-        token++;
-        Cell::Coordinates loc = coordinateIs(token);
-        curSim->cellNew(loc, Cell::cytotoxicCell());
-      } else if (*token == "helperCellNew") {
-        token++;
-        Cell::Coordinates loc = coordinateIs(token);
-        curSim->cellNew(loc, Cell::helperCell());
-      } else if (*token == "infectionStartLocationIs") {
-        token++;
-        Cell::Coordinates loc = coordinateIs(token);
-        token++; token++; token++;
-        CellMembrane::Side side = sideIs(token++);
-        AntibodyStrength strength = 
-          AntibodyStrength(lexical_cast<int>(*token++)); 
-        curSim->infectionStart(loc, side, strength);
-      } else if (*token == "infectedCellsDel") {
-        curSim->infectedCellsDel();
-      } else if (*token == "cloneCellsNew") {
-        token++;
-        CellMembrane::Side side = sideIs(token++);
-        curSim->cloneCellsNew(side);
-      } else {
-        throw "Malformed command";
-      }
+  // outlives program and its stats sink
+  ofstream statsFile;
+  if (statsPath) {
+    statsFile.open(statsPath, ios::binary);
+    if (!statsFile) {
+      cout << "error writing " << statsPath << endl;
+      return 1;
     }
-  } else if (*token == "Cell") {
-    token++;
-    Simulation::Ptr curSim = sims[*token];
-    token++;
-    Cell::Coordinates loc = coordinateIs(token);
-    token++; token++; token++;
-    if (*token == "membrane") {
-      token++;
-      CellMembrane::Side side = sideIs(token++);
-      if (*token == "antibodyStrengthIs") {
-        *token++;
-        AntibodyStrength strength = 
-          AntibodyStrength(lexical_cast<int>(*token++));
-        curSim->antibodyStrengthIs(loc, side, strength);
-      } else {
-        throw "Malformed command";
-      }
-    } else if (*token == "cloneNew") {
-      token++;
-      CellMembrane::Side side = sideIs(token++);
-      curSim->cloneNew(loc, side);
-    } else {
-      throw "Malformed command";
-    }
-  } else {
-    throw "Malformed command";
   }
-}
-
-
 
-int main(int argc, const char* argv[]) {
-  map<Fwk::String, Simulation::Ptr> sims;
-  ifstream infile(argv[1]);
-  if(infile.fail()){
+  Fwk::MappedFile::Ptr infile;
+  try {
+    infile = Fwk::MappedFile::MappedFileNew(argv[1]);
+  }
+  catch (...) {
     //File error. Halt program.
     cout << "error reading file" << endl;
     return 1;
   }
 
-  //read data in, parse it, excute commands.
-  Fwk::String textLine;
-  while(!infile.eof()){
-    getline(infile, textLine);
-    try {
-      commandIs(textLine, sims);
-    }
-    catch (...) {
-      cerr << "Excetion occurred while parseing command: [" << textLine << "]" 
-        << endl;
-    }
+  CommandProgram program;
+  char const *begin = infile->data();
+  char const *end = begin + infile->size();
+  try {
+    if (commandBinary(begin, end))
+      program.binaryCompile(begin, end);
+    else
+      program.textCompile(begin, end);
+  }
+  catch (...) {
+    cout << "error reading file" << endl;
+    return 1;
   }
+
+  StatsSink::Ptr statsSink = StatsSink::standardOut();
+  if (statsPath || format != StatsSink::text())
+    statsSink = StatsSink::StatsSinkNew(format, 
+      statsPath ? (ostream *)&statsFile : &cout);
+  statsSink->flushIntervalIs(flushInterval);
+  program.statsSinkIs(statsSink);
+
+  U32 runs = argc > 2 ? atoi(argv[2]) : 1;
+  for (U32 i = 0; i < runs; i++)
+    program.run(threads);
   return 0;
 }
@@ -1,7 +1,15 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/tokenizer.hpp>
 #include <queue>
+#include <algorithm>
+#include <pthread.h>
+#include <fstream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "fwk/MappedFile.h"
 #include "simulation.h"
+#include "TissueImage.h"
 
 using namespace std;
 using namespace boost;
@@ -22,7 +30,6 @@ string CoordToStr(Cell::Coordinates loc)
 
 void Simulation::TissueReactor::onCellNew(Cell::Ptr c)
 {
-  CellMembrane::Ptr m;
   AntibodyStrength strength;
   if (c->cellType() == Cell::cytotoxicCell()) {
     strength = AntibodyStrength(initialCytotoxicStrength);
@@ -32,18 +39,33 @@ void Simulation::TissueReactor::onCellNew(Cell::Ptr c)
     psim->helperCells_++;
   }
 
-  m = c->membraneNew(c->name() + " north", CellMembrane::north());
-  m->antibodyStrengthIs(strength);
-  m = c->membraneNew(c->name() + " south", CellMembrane::south());
-  m->antibodyStrengthIs(strength);
-  m = c->membraneNew(c->name() + " east", CellMembrane::east());
-  m->antibodyStrengthIs(strength);
-  m = c->membraneNew(c->name() + " west", CellMembrane::west());
-  m->antibodyStrengthIs(strength);
-  m = c->membraneNew(c->name() + " up", CellMembrane::up());
-  m->antibodyStrengthIs(strength);
-  m = c->membraneNew(c->name() + " down", CellMembrane::down());
-  m->antibodyStrengthIs(strength);
+  for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++)
+    c->membraneNew(CellMembrane::Side(i), strength);
+}
+
+void Simulation::TissueReactor::onCellsNew(Tissue::CellVector const & cells)
+{
+  AntibodyStrength helper(initialHelperStrength);
+  AntibodyStrength cytotoxic(initialCytotoxicStrength);
+  U32 cytotoxicNew = 0;
+  for (U32 i = 0; i < cells.size(); i++) {
+    Cell *c = cells[i].ptr();
+    bool isCytotoxic = c->cellType() == Cell::cytotoxicCell();
+    if (isCytotoxic) cytotoxicNew++;
+    for (U32 s = CellMembrane::north_; s <= CellMembrane::down_; s++)
+      c->membraneNew(CellMembrane::Side(s), isCytotoxic ? cytotoxic : helper);
+  }
+  psim->cytotoxicCells_ += cytotoxicNew;
+  psim->helperCells_ += cells.size() - cytotoxicNew;
+}
+
+void Simulation::TissueReactor::onCellsDel(Tissue::CellVector const & cells)
+{
+  U32 cytotoxic = 0;
+  for (U32 i = 0; i < cells.size(); i++)
+    if (cells[i]->cellType() == Cell::cytotoxicCell()) cytotoxic++;
+  psim->cytotoxicCells_ -= cytotoxic;
+  psim->helperCells_ -= cells.size() - cytotoxic;
 }
 
 void Simulation::TissueReactor::onCellDel(Cell::Ptr c)
@@ -56,15 +78,39 @@ void Simulation::TissueReactor::onCellDel(Cell::Ptr c)
 }
 
 // create new simulation object, wrapping a tissue_
-Simulation::Simulation(Fwk::String _name) : 
-  Fwk::NamedInterface("sim" + _name) 
+Simulation::Simulation(Fwk::String _name, Tissue::CellStorage _storage,
+                       StatsSink::Ptr _statsSink) : 
+  Fwk::NamedInterface("sim" + _name), statsSink_(_statsSink)
 {
-  tissue_ = Tissue::TissueNew(_name);
+  tissue_ = Tissue::TissueNew(_name, _storage);
   TissueReactor::Ptr r = TissueReactor::TissueReactorIs(tissue_.ptr());
   r->notifierIs(tissue_);
   ((TissueReactor *)r.ptr())->psim = this;
   helperCells_ = 0;
   cytotoxicCells_ = 0;
+  infectionThreads_ = 1;
+}
+
+void Simulation::statsSinkIs(StatsSink::Ptr _sink)
+{
+  statsSink_ = _sink;
+}
+
+void Simulation::infectionThreadsIs(U32 _threads)
+{
+  infectionThreads_ = _threads ? _threads : 1;
+}
+
+void Simulation::workersRun(void *(*run)(void *), void *arg, U32 threads)
+{
+  vector<pthread_t> worker(threads > 1 ? threads - 1 : 0);
+  U32 workers = 0;
+  while (workers < worker.size() &&
+         !pthread_create(&worker[workers], 0, run, arg))
+    workers++;
+  run(arg);
+  for (U32 w = 0; w < workers; w++)
+    pthread_join(worker[w], 0);
 }
 
 Tissue::Ptr Simulation::tissue()
@@ -124,6 +170,18 @@ int printQueue(queue<Cell::Ptr> q)
   return count;
 }
 
+// Order in which a cell attacks its neighbors.  The parallel expansion
+// must follow it to reproduce the serial statistics.
+static const CellMembrane::Side infectionSide[] = {
+  CellMembrane::north_, CellMembrane::east_, CellMembrane::south_,
+  CellMembrane::west_, CellMembrane::up_, CellMembrane::down_
+};
+static const U32 infectionSides = 6;
+
+// A level goes bottom-up once frontier * bottomUpRatio exceeds the healthy
+// cells left, the usual direction-optimizing BFS threshold.
+static const U32 bottomUpRatio = 14;
+
 /*
 Starts an infection of strength 99 at cell at "loc" entering from the "loc"
 membrane. You should proceed to the next command only when no more cells can be 
@@ -133,75 +191,505 @@ standard out as described here.
 void Simulation::infectionStart(Cell::Coordinates loc, 
                     CellMembrane::Side side, AntibodyStrength strength)
 {
+  InfectionSeed seed;
+  seed.loc = loc;
+  seed.side = side;
+  infectionStart(vector<InfectionSeed>(1, seed), strength);
+}
 
+/*
+Starts one infection from several seeds.  Each seed is attacked in turn,
+as a root would be, and the seeds infected make up the first round; the
+infection then spreads from all of them at once, a round at a time.  One
+line of statistics covers the whole infection.  Its path is the number
+of rounds, so a cell infected in the last round is path - 1 steps from the
+nearest infected seed; it is 0 if no seed was infected.
+*/
+void Simulation::infectionStart(vector<InfectionSeed> const &seeds,
+                                AntibodyStrength strength)
+{
   U32 attempts = 0;
   S32 difference = 0;
   U32 path = 0;
 
-  Cell::Ptr rootCell = *(tissue_->cellIter(loc)); 
-  if (!rootCell) {
-    stats(attempts, difference, path);
-    return;
+  // Cells stay referenced by tissue_ for the whole infection, so the
+  // frontier holds raw pointers.  A level goes top-down, following the
+  // neighbor links of frontier cells, until the frontier is large next to
+  // the healthy cells left; then it goes bottom-up, scanning the healthy
+  // cells for frontier neighbors.
+  vector<Cell *> curRound, nextRound;
+  for (U32 i = 0; i < seeds.size(); i++) {
+    Cell *c = tissue_->cell(seeds[i].loc).ptr();
+    if (infectionSpreadTo(c, seeds[i].side, strength, difference, attempts))
+      curRound.push_back(c);
   }
 
-  if (!infectionSpreadTo(rootCell, side, strength, difference, attempts)) {
-    stats(attempts, difference, path);
-    return;
+  while (!curRound.empty()) {
+    U32 healthy = tissue_->cells() - tissue_->infectedCells();
+    if (curRound.size() * bottomUpRatio > healthy)
+      infectionRoundBottomUp(curRound, nextRound, strength, difference, 
+                             attempts);
+    else if (infectionThreads_ > 1)
+      infectionRoundExpand(curRound, nextRound, strength, difference, 
+                           attempts);
+    else
+      infectionRoundTopDown(curRound, nextRound, strength, difference, 
+                            attempts);
+    swap(curRound, nextRound);
+    path++;
   }
-  
-  queue<Cell::Ptr> curRound, nextRound;
-  curRound.push(rootCell);
 
-  while (!curRound.empty()) {
-    Cell::Ptr c = curRound.front();
-    curRound.pop();
-      
-    Cell::Ptr nbr;
-    CellMembrane::Side side;
-
-    side = CellMembrane::north(); 
-    nbr = neighbor(c, side); 
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    side = CellMembrane::east(); 
-    nbr = neighbor(c, side); 
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    side = CellMembrane::south(); 
-    nbr = neighbor(c, side);
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    side = CellMembrane::west(); 
-    nbr = neighbor(c, side);
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    side = CellMembrane::up(); 
-    nbr = neighbor(c, side);
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    side = CellMembrane::down(); 
-    nbr = neighbor(c, side);
-    if (infectionSpreadTo(nbr, oppositeSide(side), strength, difference, attempts))
-        nextRound.push(nbr);
-
-    if (curRound.empty()) {
-      swap(curRound,nextRound);
-      path++;
+  stats(attempts, difference, path);
+}
+
+// Infection kernels over 64 consecutive cell strengths, one bitset word
+// of the tissue's dense cell index.  SSE2 handles 16 cells per
+// instruction; other targets use the scalar loops.
+
+// Mask of the cells whose strength is below attack.
+static U64 strengthsBelow(U8 const *strength, U8 attack)
+{
+  U64 mask = 0;
+#ifdef __SSE2__
+  __m128i a = _mm_set1_epi8((char)attack);
+  for (U32 j = 0; j < 4; j++) {
+    __m128i s = _mm_loadu_si128((__m128i const *)(strength + j * 16));
+    // attack > s exactly when max(attack, s) differs from s
+    U32 notBelow = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(a, s), s));
+    mask |= U64(~notBelow & 0xffff) << (j * 16);
+  }
+#else
+  for (U32 j = 0; j < 64; j++)
+    if (attack > strength[j])
+      mask |= U64(1) << j;
+#endif
+  return mask;
+}
+
+// Sum of the strengths of the cells in lanes.
+static U32 strengthsSum(U8 const *strength, U64 lanes)
+{
+  U32 sum = 0;
+#ifdef __SSE2__
+  const __m128i bit = _mm_set1_epi64x(0x8040201008040201ULL);
+  for (U32 j = 0; j < 4; j++) {
+    U32 b = U32(lanes >> (j * 16)) & 0xffff;
+    if (!b)
+      continue;
+    // spread the 16 lane bits over 16 bytes, 0xff where set
+    __m128i v = _mm_set_epi64x(0x0101010101010101ULL * (b >> 8),
+                               0x0101010101010101ULL * (b & 0xff));
+    __m128i sel = _mm_cmpeq_epi8(_mm_and_si128(v, bit), bit);
+    __m128i s = _mm_loadu_si128((__m128i const *)(strength + j * 16));
+    __m128i sad = _mm_sad_epu8(_mm_and_si128(s, sel), _mm_setzero_si128());
+    sum += _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+  }
+#else
+  for (; lanes; lanes &= lanes - 1)
+    sum += strength[__builtin_ctzll(lanes)];
+#endif
+  return sum;
+}
+
+// One attack on a healthy neighbor, numbered in serial order.
+struct InfectionAttack {
+  Cell *cell;
+  U32 index;
+  S32 difference;
+};
+
+// A contiguous part of the frontier expanded by one thread.  A thread
+// started for a slice waits on start while the slices are dealt out.
+struct InfectionSlice {
+  pthread_mutex_t *start;
+  pthread_barrier_t *barrier;
+  Cell * const *frontier;
+  U32 begin, end;
+  U64 stamp;
+  AntibodyStrength attack;
+  vector<InfectionAttack> attacks;
+  vector<Cell *> next;
+  U32 attempts;
+  S32 difference;
+};
+
+// First pass records every attack on a healthy neighbor and claims each
+// neighbor the attack would infect; the lowest attack index wins.  After
+// all slices are done, the second pass counts only attacks made up to and
+// including the winning one, since the serial run skips a cell once it is
+// infected, and collects the winners in serial order.  Winners are marked
+// infected after the threads join, since that updates the tissue's
+// shared infected set.
+static void *infectionSliceExpand(void *arg)
+{
+  InfectionSlice *s = (InfectionSlice *)arg;
+  if (s->start) {
+    pthread_mutex_lock(s->start);
+    pthread_mutex_unlock(s->start);
+  }
+  for (U32 i = s->begin; i < s->end; i++) {
+    Cell *c = s->frontier[i];
+    for (U32 k = 0; k < infectionSides; k++) {
+      Cell *nbr = c->neighbor(infectionSide[k]);
+      if (!nbr || nbr->health() == Cell::infected())
+        continue;
+      AntibodyStrength defense = 
+        nbr->antibodyStrength(CellMembrane::opposite(infectionSide[k]));
+      InfectionAttack a;
+      a.cell = nbr;
+      a.index = i * infectionSides + k;
+      a.difference = (S32)s->attack.value() - (S32)defense.value();
+      s->attacks.push_back(a);
+      if (s->attack > defense)
+        nbr->infectionClaimIs(s->stamp | a.index);
     }
+  }
 
+  if (s->barrier)
+    pthread_barrier_wait(s->barrier);
+
+  for (U32 i = 0; i < s->attacks.size(); i++) {
+    InfectionAttack const &a = s->attacks[i];
+    U64 claim = a.cell->infectionClaim();
+    bool claimed = claim >= s->stamp;
+    if (claimed && a.index > U32(claim))
+      continue;
+    s->attempts++;
+    s->difference += a.difference;
+    if (claimed && a.index == U32(claim))
+      s->next.push_back(a.cell);
   }
+  return 0;
+}
 
-  stats(attempts, difference, path);
+// Expands one infection round across infectionThreads_ threads, leaving
+// the newly infected cells in nextRound in the order a serial expansion
+// would have queued them.
+void Simulation::infectionRoundExpand(vector<Cell *>& curRound, 
+                                      vector<Cell *>& nextRound,
+                                      AntibodyStrength attack,
+                                      S32& difference,
+                                      U32& attempts)
+{
+  // Below this many frontier cells per thread, threading costs more than
+  // it saves.
+  static const U32 minSlice = 256;
+  static U32 roundStamp = 0;
+
+  U32 size = curRound.size();
+  U32 threads = infectionThreads_;
+  if (threads > size / minSlice)
+    threads = size / minSlice;
+  if (threads < 1)
+    threads = 1;
+
+  // The threads are started first and the frontier is split among those
+  // that could be, so that a failed pthread_create leaves no slice
+  // behind and no thread waiting at the barrier for it.
+  vector<InfectionSlice> slices(threads);
+  vector<pthread_t> tid(threads);
+  pthread_mutex_t start;
+  pthread_mutex_init(&start, NULL);
+  pthread_mutex_lock(&start);
+  U32 started = 1;
+  for (; started < threads; started++) {
+    slices[started].start = &start;
+    if (pthread_create(&tid[started], NULL, infectionSliceExpand, 
+                       &slices[started]))
+      break;
+  }
+  threads = started;
+  slices[0].start = NULL;
+
+  pthread_barrier_t barrier;
+  if (threads > 1)
+    pthread_barrier_init(&barrier, NULL, threads);
+  U64 stamp = U64(__sync_add_and_fetch(&roundStamp, 1)) << 32;
+  for (U32 t = 0; t < threads; t++) {
+    InfectionSlice &s = slices[t];
+    s.barrier = threads > 1 ? &barrier : NULL;
+    s.frontier = &curRound[0];
+    s.begin = U64(size) * t / threads;
+    s.end = U64(size) * (t + 1) / threads;
+    s.stamp = stamp;
+    s.attack = attack;
+    s.attempts = 0;
+    s.difference = 0;
+  }
+
+  pthread_mutex_unlock(&start);
+  infectionSliceExpand(&slices[0]);
+  for (U32 t = 1; t < threads; t++)
+    pthread_join(tid[t], NULL);
+  if (threads > 1)
+    pthread_barrier_destroy(&barrier);
+  pthread_mutex_destroy(&start);
+
+  nextRound.clear();
+  for (U32 t = 0; t < threads; t++) {
+    attempts += slices[t].attempts;
+    difference += slices[t].difference;
+    nextRound.insert(nextRound.end(), slices[t].next.begin(), 
+                     slices[t].next.end());
+  }
+  for (U32 i = 0; i < nextRound.size(); i++)
+    nextRound[i]->healthIs(Cell::infected());
+}
+
+// Expands one infection round on the calling thread, following the
+// neighbor links of each frontier cell in order.
+void Simulation::infectionRoundTopDown(vector<Cell *>& curRound, 
+                                       vector<Cell *>& nextRound,
+                                       AntibodyStrength attack,
+                                       S32& difference,
+                                       U32& attempts)
+{
+  nextRound.clear();
+  for (U32 j = 0; j < curRound.size(); j++) {
+    Cell *c = curRound[j];
+    for (U32 i = 0; i < infectionSides; i++) {
+      Cell *nbr = c->neighbor(infectionSide[i]);
+      if (infectionSpreadTo(nbr, oppositeSide(infectionSide[i]), attack,
+                            difference, attempts))
+        nextRound.push_back(nbr);
+    }
+  }
+}
+
+// Expands one infection round bottom-up.  The frontier becomes a bitset
+// over the tissue's dense cell index, and the healthy cells are found by
+// scanning the tissue's infected set a word at a time.  For each word, the
+// cells attacked on each side are gathered into a mask and compared with
+// the tissue's per-side strength arrays 64 at a time.  An attacked cell no
+// attack can infect counts all its attacks, which is summed in bulk.  A
+// cell that is infected replays the attacks from its frontier neighbors in
+// the order a top-down round would make them, ranked by the attacker's
+// frontier position and then by side, and is queued in that same order.
+void Simulation::infectionRoundBottomUp(vector<Cell *>& curRound, 
+                                        vector<Cell *>& nextRound,
+                                        AntibodyStrength attack,
+                                        S32& difference,
+                                        U32& attempts)
+{
+  U32 cells = tissue_->cells();
+  frontier_.sizeIs(cells);
+  frontierRank_.resize(cells);
+  for (U32 j = 0; j < curRound.size(); j++) {
+    U32 idx = curRound[j]->index();
+    frontier_.bitIs(idx, true);
+    frontierRank_[idx] = j;
+  }
+
+  U8 const *strength[infectionSides];
+  for (U32 s = 0; s < infectionSides; s++)
+    strength[s] = tissue_->antibodyStrengths(CellMembrane::Side(s));
+
+  vector<pair<U64, Cell *> > infected;
+  Fwk::Bitset const &infectedSet = tissue_->infectedSet();
+  for (U32 w = 0; w < infectedSet.words(); w++) {
+    U64 healthy = ~infectedSet.word(w);
+    if (w == infectedSet.words() - 1 && (cells & 63))
+      healthy &= (U64(1) << (cells & 63)) - 1;
+
+    // attacked[s]: cells with a frontier neighbor on their side s
+    U64 attacked[infectionSides] = { 0 };
+    for (U64 h = healthy; h; h &= h - 1) {
+      U32 lane = __builtin_ctzll(h);
+      Cell *c = tissue_->cellIndexed((w << 6) + lane);
+      for (U32 s = 0; s < infectionSides; s++) {
+        Cell *f = c->neighbor(CellMembrane::Side(s));
+        if (f && frontier_.bit(f->index()))
+          attacked[s] |= U64(1) << lane;
+      }
+    }
+
+    U64 won = 0;
+    for (U32 s = 0; s < infectionSides; s++)
+      if (attacked[s])
+        won |= attacked[s] & strengthsBelow(strength[s] + (w << 6), 
+                                            attack.value());
+
+    for (U32 s = 0; s < infectionSides; s++) {
+      U64 failed = attacked[s] & ~won;
+      if (!failed)
+        continue;
+      U32 n = __builtin_popcountll(failed);
+      attempts += n;
+      difference += S32(n * attack.value()) - 
+                    S32(strengthsSum(strength[s] + (w << 6), failed));
+    }
+
+    for (; won; won &= won - 1) {
+      Cell *c = tissue_->cellIndexed((w << 6) + __builtin_ctzll(won));
+
+      U64 order[infectionSides];
+      AntibodyStrength defense[infectionSides];
+      U32 n = 0;
+      for (U32 k = 0; k < infectionSides; k++) {
+        CellMembrane::Side side = oppositeSide(infectionSide[k]);
+        Cell *f = c->neighbor(side);
+        if (!f || !frontier_.bit(f->index()))
+          continue;
+        U64 o = U64(frontierRank_[f->index()]) * infectionSides + k;
+        U32 m = n++;
+        for (; m > 0 && order[m - 1] > o; m--) {
+          order[m] = order[m - 1];
+          defense[m] = defense[m - 1];
+        }
+        order[m] = o;
+        defense[m] = c->antibodyStrength(side);
+      }
+
+      for (U32 m = 0; m < n; m++) {
+        attempts++;
+        difference += (S32)attack.value() - (S32)defense[m].value();
+        if (attack > defense[m]) {
+          c->healthIs(Cell::infected());
+          infected.push_back(make_pair(order[m], c));
+          break;
+        }
+      }
+    }
+  }
+
+  for (U32 j = 0; j < curRound.size(); j++)
+    frontier_.bitIs(curRound[j]->index(), false);
+
+  sort(infected.begin(), infected.end());
+  nextRound.clear();
+  for (U32 i = 0; i < infected.size(); i++)
+    nextRound.push_back(infected[i].second);
+}
+
+// The runs of a batch, claimed one at a time by the threads.
+struct Simulation::InfectionBatch {
+  Simulation *sim;
+  vector<InfectionRun> const *runs;
+  vector<Cell *> root;
+  vector<InfectionStats> *stats;
+  U32 next;
+};
+
+void *Simulation::infectionBatchRun(void *arg)
+{
+  InfectionBatch *b = (InfectionBatch *)arg;
+  Fwk::Bitset infected;
+  infected.sizeIs(b->sim->tissue_->cells());
+  vector<Cell *> cells;
+  for (;;) {
+    U32 i = __sync_fetch_and_add(&b->next, 1);
+    if (i >= b->runs->size())
+      return 0;
+    b->sim->infectionRun((*b->runs)[i], b->root[i], (*b->stats)[i], 
+                         infected, cells);
+  }
+}
+
+// One run of a batch: a serial top-down infection over the neighbor links
+// that marks cells in infected, by index, instead of changing their
+// health.  root is the cell at the run's location, if any, looked up
+// beforehand since a Cell::Ptr must not be taken on several threads at
+// once.  cells collects the infected cells, one round after another,
+// and is the queue of the rounds; their bits are cleared at the end, so
+// infected can be used for the next run.  Only reads the tissue.
+void Simulation::infectionRun(InfectionRun const &run, Cell *root,
+                              InfectionStats &stats, Fwk::Bitset &infected,
+                              vector<Cell *> &cells)
+{
+  Fwk::Bitset const &base = tissue_->infectedSet();
+  U32 attempts = 0;
+  S32 difference = 0;
+  U32 path = 0;
+  Cell::Coordinates lo = {0, 0, 0}, hi = {0, 0, 0};
+  if (base.members()) {
+    lo = tissue_->infectedMin();
+    hi = tissue_->infectedMax();
+  }
+
+  cells.clear();
+  if (root && !base.bit(root->index())) {
+    attempts++;
+    AntibodyStrength defense = root->antibodyStrength(run.side);
+    difference += (S32)run.strength.value() - (S32)defense.value();
+    if (run.strength > defense) {
+      infected.bitIs(root->index(), true);
+      cells.push_back(root);
+    }
+  }
+
+  for (U32 begin = 0, end = cells.size(); begin < end; 
+       begin = end, end = cells.size()) {
+    for (U32 j = begin; j < end; j++) {
+      for (U32 k = 0; k < infectionSides; k++) {
+        Cell *nbr = cells[j]->neighbor(infectionSide[k]);
+        if (!nbr || base.bit(nbr->index()) || infected.bit(nbr->index()))
+          continue;
+        attempts++;
+        AntibodyStrength defense = 
+          nbr->antibodyStrength(oppositeSide(infectionSide[k]));
+        difference += (S32)run.strength.value() - (S32)defense.value();
+        if (run.strength > defense) {
+          infected.bitIs(nbr->index(), true);
+          cells.push_back(nbr);
+        }
+      }
+    }
+    path++;
+  }
+
+  for (U32 j = 0; j < cells.size(); j++) {
+    Cell::Coordinates loc = cells[j]->location();
+    if (!base.members() && j == 0) {
+      lo = hi = loc;
+    } else {
+      lo.x = min(lo.x, loc.x);
+      lo.y = min(lo.y, loc.y);
+      lo.z = min(lo.z, loc.z);
+      hi.x = max(hi.x, loc.x);
+      hi.y = max(hi.y, loc.y);
+      hi.z = max(hi.z, loc.z);
+    }
+    infected.bitIs(cells[j]->index(), false);
+  }
+
+  stats.infectedCells = base.members() + cells.size();
+  stats.attempts = attempts;
+  stats.difference = difference;
+  stats.cytotoxicCells = cytotoxicCells_;
+  stats.helperCells = helperCells_;
+  stats.volume = stats.infectedCells ? 
+    (hi.x - lo.x + 1) * (hi.y - lo.y + 1) * (hi.z - lo.z + 1) : 0;
+  stats.path = path;
+}
+
+vector<InfectionStats> Simulation::infectionBatch(
+  vector<InfectionRun> const &runs, U32 threads)
+{
+  vector<InfectionStats> stats(runs.size());
+  // Settle what the runs read: the deferred notifications that build
+  // membranes, and the infected box, which is rescanned lazily.
+  tissue_->notificationsDispatch();
+  tissue_->infectionVolume();
+
+  InfectionBatch batch;
+  batch.sim = this;
+  batch.runs = &runs;
+  batch.root.resize(runs.size());
+  for (U32 i = 0; i < runs.size(); i++)
+    batch.root[i] = tissue_->cell(runs[i].loc).ptr();
+  batch.stats = &stats;
+  batch.next = 0;
+  if (threads > runs.size())
+    threads = runs.size();
+  if (threads < 1)
+    threads = 1;
+  workersRun(infectionBatchRun, &batch, threads);
+  return stats;
 }
 
 // spreads an infection to cell from specific side. updates statistics
 // as well
-bool Simulation::infectionSpreadTo(Cell::Ptr c, CellMembrane::Side side, 
+bool Simulation::infectionSpreadTo(Cell *c, CellMembrane::Side side, 
                                    AntibodyStrength attack, 
                                    S32& difference,
                                    U32& attempts)
@@ -210,9 +698,9 @@ bool Simulation::infectionSpreadTo(Cell::Ptr c, CellMembrane::Side side,
     return false;
 
   attempts++;
-  CellMembrane::Ptr m = *(c->membraneIterConst(side));
-  difference += (S32)attack.value()  - (S32)m->antibodyStrength().value();
-  if (attack > m->antibodyStrength()) {
+  AntibodyStrength defense = c->antibodyStrength(side);
+  difference += (S32)attack.value()  - (S32)defense.value();
+  if (attack > defense) {
     c->healthIs(Cell::infected());
     return true;
   }
@@ -223,87 +711,87 @@ bool Simulation::infectionSpreadTo(Cell::Ptr c, CellMembrane::Side side,
 void Simulation::stats(U32 attempts, S32 difference, 
                        U32 path)
 {
-  cout << infectedCells() << " " << attempts << " " 
-    << difference << " " << cytotoxicCells_ << " " 
-    << helperCells_ << " " << infectionVolume() << " " 
-    << path << endl;
+  if (!statsSink_)
+    return;
+  InfectionStats s;
+  s.infectedCells = infectedCells();
+  s.attempts = attempts;
+  s.difference = difference;
+  s.cytotoxicCells = cytotoxicCells_;
+  s.helperCells = helperCells_;
+  s.volume = infectionVolume();
+  s.path = path;
+  statsSink_->statsNew(tissue_->name(), s);
 }
 
 //returns the neighbor of a cell in a particular direction
 Cell::Ptr Simulation::neighbor(Cell::Ptr c, CellMembrane::Side side)
 {
-  Cell::Coordinates loc = c->location();
-
-  if (side == CellMembrane::north())
-    loc.y++;
-
-  else if (side == CellMembrane::south())
-    loc.y--;
-
-  else if (side == CellMembrane::east())
-    loc.x++;
-
-  else if (side == CellMembrane::west())
-    loc.x--;
-
-  else if (side == CellMembrane::up())
-    loc.z++;
-
-  else if (side == CellMembrane::down())
-    loc.z--;
-
-  else 
-    return NULL;
-
-
-  return (*tissue_->cellIter(loc));
+  return c->neighbor(side);
 }
 
 // returns the inverted side. north becomes south, east becomes west, 
 // and so forth
 CellMembrane::Side Simulation::oppositeSide(CellMembrane::Side side) 
 {
-  if (side == CellMembrane::north())
-    return CellMembrane::south();
-
-  if (side == CellMembrane::south())
-    return CellMembrane::north();
-
-  if (side == CellMembrane::east())
-    return CellMembrane::west();
-
-  if (side == CellMembrane::west())
-    return CellMembrane::east();
-
-  if (side == CellMembrane::up()) 
-    return CellMembrane::down();
+  return CellMembrane::opposite(side);
+}
 
-  if (side == CellMembrane::down()) 
-    return CellMembrane::up();
 
-  return side;
+static bool cellInfected(Cell const *c)
+{
+  return c->health() == Cell::infected();
 }
 
-
 // Remove all infected cells from "_tissue_".
 void Simulation::infectedCellsDel()
 {
-  queue<Fwk::String> cellsQueue;
-  
-  for (Tissue::CellIterator it = tissue_->cellIter(); it; ++it) {
-    Cell::Ptr c = *it;
-    if (c->health() == Cell::infected()) {
-      cellsQueue.push(c->name());
-    }
-  }
+  tissue_->cellsDelIf(cellInfected);
+}
 
-  while (!cellsQueue.empty()) {
-    Fwk::String s = cellsQueue.front();
-    cellsQueue.pop();
-    tissue_->cellDel(s);
+void Simulation::snapshotWrite(Fwk::String _path)
+{
+  vector<char> snapshot;
+  tissue_->snapshotWrite(snapshot);
+  ofstream out(_path.c_str(), ios::binary);
+  out.write(&snapshot[0], snapshot.size());
+  if (!out.flush())
+    throw Fwk::StorageException(_path);
+}
+
+void Simulation::snapshotRead(Fwk::String _path)
+{
+  Fwk::MappedFile::Ptr in = Fwk::MappedFile::MappedFileNew(_path);
+  tissue_->snapshotRead(in->data(), in->size());
+  for (U32 i = 0; i < tissue_->cells(); i++) {
+    if (tissue_->cellIndexed(i)->cellType() == Cell::cytotoxicCell())
+      cytotoxicCells_++;
+    else
+      helperCells_++;
   }
 }
 
+Simulation::Ptr Simulation::fork(Fwk::String _name)
+{
+  Simulation::Ptr child = SimulationNew(_name, tissue_->cellStorage(), 
+                                        statsSink_);
+  child->tissue_->cellsCopy(tissue_.ptr());
+  child->cytotoxicCells_ = cytotoxicCells_;
+  child->helperCells_ = helperCells_;
+  child->infectionThreads_ = infectionThreads_;
+  return child;
+}
+
+void Simulation::imageWrite(Fwk::String _path)
+{
+  vector<char> image;
+  TissueImage::imageWrite(tissue_.ptr(), cytotoxicCells_, helperCells_, image);
+  ofstream out(_path.c_str(), ios::binary);
+  out.write(&image[0], image.size());
+  if (!out.flush())
+    throw Fwk::StorageException(_path);
+}
+
 /*
 Clones cell at location "loc" and places the new cell "side" of "loc"
 Like the other cell creation commands, the simulation should 
@@ -319,13 +807,14 @@ void Simulation::cloneNew(Cell::Coordinates loc,
   Cell::Coordinates cloneLoc = coordinateShifted(loc, side); 
   // cout << CoordToStr(cloneLoc) << endl;
   Cell::Ptr clone = cellNew(cloneLoc, ctype);
+  // the reactor gives the clone its membranes, possibly deferred
+  tissue_->notificationsDispatch();
   
   clone->healthIs(c->health());
 
-  for (Cell::MembraneIteratorConst it = c->membraneIterConst(); it; ++it) {
-    CellMembrane::Ptr m = *it;
-    CellMembrane::Ptr mclone = *(clone->membraneIterConst(m->side()));
-    mclone->antibodyStrengthIs(m->antibodyStrength());
+  for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++) {
+    CellMembrane::Side side = CellMembrane::Side(i);
+    clone->antibodyStrengthIs(side, c->antibodyStrength(side));
   }
 }
 
@@ -333,21 +822,7 @@ void Simulation::cloneNew(Cell::Coordinates loc,
 Cell::Coordinates Simulation::coordinateShifted(Cell::Coordinates loc, 
                                                CellMembrane::Side side)
 {
-  Cell::Coordinates shiftLoc = loc;
-  if (side == CellMembrane::north())
-    shiftLoc.y++;
-  else if (side == CellMembrane::south())
-    shiftLoc.y--;
-  else if (side == CellMembrane::east())
-   shiftLoc.x++;
-  else if (side == CellMembrane::west())
-    shiftLoc.x--;
-  else if (side == CellMembrane::up())
-    shiftLoc.z++;
-  else if (side == CellMembrane::down())
-    shiftLoc.z--;
-
-  return shiftLoc;
+  return loc.shifted(side);
 }
 
 // sets the antibody stength of a cell in the simulation tissue_
@@ -357,9 +832,9 @@ void Simulation::antibodyStrengthIs(Cell::Coordinates loc,
   Cell::Ptr c = *(tissue_->cellIter(loc));
   if (!c) 
     cellNew(loc, DEFAULT_CELL_TYPE);
-  CellMembrane::Ptr m = *(c->membraneIterConst(side));
-  assertValidPtr(m);
-  m->antibodyStrengthIs(strength);
+  if (!c->membraneExists(side))
+    throw "null pointer exception";
+  c->antibodyStrengthIs(side, strength);
 }
 
 /*
@@ -370,78 +845,105 @@ simulation and clone the remaining cells.
 */
 void Simulation::cloneCellsNew(CellMembrane::Side side) 
 {
-  queue<Cell::Coordinates> cellsQueue;
-  for (Tissue::CellIterator it = tissue_->cellIter(); it; ++it) {
-    Cell::Ptr c = *it;
-    if (c)
-      cellsQueue.push(c->location());
+  // A shift maps distinct cells to distinct targets, so a target can only
+  // be taken by a cell already in the tissue, never by another clone.  The
+  // neighbor link on side tells whether it is, so one pass finds every
+  // clone to make without lookups or exceptions.
+  vector<Cell *> sources;
+  sources.reserve(tissue_->cells());
+  for (U32 i = 0; i < tissue_->cells(); i++) {
+    Cell *c = tissue_->cellIndexed(i);
+    if (!c->neighbor(side))
+      sources.push_back(c);
   }
 
-  while (!cellsQueue.empty()) {
-    Cell::Coordinates loc = cellsQueue.front();
-    cellsQueue.pop();
-    try {
-      cloneNew(loc, side);
-    } catch(...) {
-      //do nothing
+  tissue_->cellsReserve(tissue_->cells() + sources.size());
+  vector<Cell *> clones(sources.size());
+  {
+    // The reactor gives the clones their membranes when the batch closes;
+    // their strengths are copied after that.
+    Tissue::NotificationBatch batch(tissue_.ptr());
+    if (tissue_->cellStorage() == Tissue::shardedStorage() &&
+        infectionThreads_ > 1) {
+      cloneShardsNew(sources, side, clones);
+    } else {
+      for (U32 i = 0; i < sources.size(); i++) {
+        Cell *c = sources[i];
+        Cell::Ptr clone = Cell::CellNew(c->location().shifted(side), 
+                                        tissue_.ptr(), c->cellType());
+        tissue_->cellIs(clone);
+        clone->healthIs(c->health());
+        clones[i] = clone.ptr();
+      }
+    }
+  }
+  tissue_->notificationsDispatch();
+  for (U32 i = 0; i < clones.size(); i++) {
+    for (U32 m = CellMembrane::north_; m <= CellMembrane::down_; m++) {
+      CellMembrane::Side ms = CellMembrane::Side(m);
+      clones[i]->antibodyStrengthIs(ms, sources[i]->antibodyStrength(ms));
     }
   }
 }
 
-
-// Calculates the bounding box around infected cells
-U32 Simulation::infectionVolume()
+// The clones of cloneCellsNew that fall in the shards one worker takes.
+// Each worker adds the clones of a whole shard at a time, so workers
+// mostly lock different shards and never touch the same cell.
+struct Simulation::CloneShards {
+  Tissue *tissue;
+  vector<Cell *> const *sources;
+  vector<Cell *> *clones;
+  vector<vector<U32> > shard;
+  CellMembrane::Side side;
+  U32 next;
+};
+
+void *Simulation::cloneShardsRun(void *arg)
 {
-  Tissue::CellIterator it = tissue_->cellIter();
-
-  // Loop to find first infected cell
-  for (; it; ++it) {
-    Cell::Ptr c = *it;
-    if (c->health() == Cell::infected())
-      break;
+  CloneShards *c = static_cast<CloneShards *>(arg);
+  for (;;) {
+    U32 s = __sync_fetch_and_add(&c->next, 1);
+    if (s >= c->shard.size())
+      return 0;
+    for (U32 k = 0; k < c->shard[s].size(); k++) {
+      U32 i = c->shard[s][k];
+      Cell *source = (*c->sources)[i];
+      Cell::Ptr clone = Cell::CellNew(source->location().shifted(c->side),
+                                      c->tissue, source->cellType());
+      c->tissue->cellIs(clone);
+      clone->healthIs(source->health());
+      (*c->clones)[i] = clone.ptr();
+    }
   }
-  if (!it)
-    return 0;
-
-  Cell::Coordinates minLoc = (*it)->location();
-  Cell::Coordinates maxLoc = (*it)->location();
-
-  for (++it; it; ++it) {
-    Cell::Ptr c = *it;
-
-    if (c->health() == Cell::healthy())
-      continue;
-
-    Cell::Coordinates loc = c->location();
-
-    if (loc.x < minLoc.x)
-      minLoc.x = loc.x;
-    if (loc.y < minLoc.y)
-      minLoc.y = loc.y;
-    if (loc.z < minLoc.z)
-      minLoc.z = loc.z;
+}
 
-    if (loc.x > maxLoc.x)
-      maxLoc.x = loc.x;
-    if (loc.y > maxLoc.y)
-      maxLoc.y = loc.y;
-    if (loc.z > maxLoc.z)
-      maxLoc.z = loc.z;
-  }
+void Simulation::cloneShardsNew(vector<Cell *> const &sources,
+                                CellMembrane::Side side,
+                                vector<Cell *> &clones)
+{
+  CloneShards c;
+  c.tissue = tissue_.ptr();
+  c.sources = &sources;
+  c.clones = &clones;
+  c.shard.resize(Tissue::CellShards::shards);
+  c.side = side;
+  c.next = 0;
+  for (U32 i = 0; i < sources.size(); i++)
+    c.shard[Tissue::CellShards::shard(sources[i]->location().shifted(side))]
+      .push_back(i);
+
+  workersRun(cloneShardsRun, &c,
+             min(infectionThreads_, U32(Tissue::CellShards::shards)));
+}
 
-  return (maxLoc.x - minLoc.x + 1) * (maxLoc.y - minLoc.y + 1) *
-          (maxLoc.z - minLoc.z + 1);
+// Volume of the bounding box around infected cells
+U32 Simulation::infectionVolume()
+{
+  return tissue_->infectionVolume();
 }
 
 // returns the total number of infected cells in tissue_
 U32 Simulation::infectedCells() 
 { 
-  U32 count = 0;
-  for (Tissue::CellIterator it = tissue_->cellIter(); it; ++it) {
-    Cell::Ptr c = *it;
-    if (c->health() == Cell::infected()) {
-      count++;
-    }
-  }
-  return count;
+  return tissue_->infectedCells();
 }
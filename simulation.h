@@ -5,7 +5,9 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/tokenizer.hpp>
 #include <map>
+#include <vector>
 #include "fwk/LinkedList.h"
+#include "stats.h"
 #include "Tissue.h"
 
 using namespace std;
@@ -13,6 +15,19 @@ using namespace boost;
 
 #define DEFAULT_CELL_TYPE (Cell::helperCell())
 
+// Where an infection enters the tissue.
+struct InfectionSeed {
+	Cell::Coordinates loc;
+	CellMembrane::Side side;
+};
+
+// One infection of a batch: where it starts and how strong it is.
+struct InfectionRun {
+	Cell::Coordinates loc;
+	CellMembrane::Side side;
+	AntibodyStrength strength;
+};
+
 class Simulation : public Fwk::NamedInterface
 {
 
@@ -20,8 +35,10 @@ public:
 
   typedef Fwk::Ptr<Simulation const> PtrConst;
   typedef Fwk::Ptr<Simulation> Ptr;
-	static Simulation::Ptr SimulationNew(Fwk::String _name) {
-      Ptr s = new Simulation(_name);
+	static Simulation::Ptr SimulationNew(Fwk::String _name,
+      Tissue::CellStorage _storage = Tissue::hashedStorage(),
+      StatsSink::Ptr _statsSink = StatsSink::standardOut()) {
+      Ptr s = new Simulation(_name, _storage, _statsSink);
       s->referencesDec(1);
       return s;
    }
@@ -37,9 +54,49 @@ public:
 
 	void infectionStart(Cell::Coordinates loc, CellMembrane::Side side, 
 											AntibodyStrength strength);
+	void infectionStart(vector<InfectionSeed> const &seeds,
+	                    AntibodyStrength strength);
+	// Infects from every seed at once in one pass; see simulation.cpp for
+	// how the seeds and path are counted.
 
 	void infectedCellsDel();
 
+	vector<InfectionStats> infectionBatch(vector<InfectionRun> const &runs,
+	                                      U32 threads = 1);
+	// Runs each infection against the tissue as it is now, leaving it
+	// unchanged, and returns the stats each would have printed, in order.
+	// A run keeps the cells it infects in a bitmap of its own, so runs are
+	// independent and are spread over up to threads threads.
+
+	U32 infectionThreads() const { return infectionThreads_; }
+	void infectionThreadsIs(U32 _threads);
+	// Threads used to expand each infection round, and to add the clones
+	// of cloneCellsNew on a sharded tissue; 1 runs serially.  The stats
+	// printed are identical for any thread count.
+
+	StatsSink::Ptr statsSink() const { return statsSink_; }
+	void statsSinkIs(StatsSink::Ptr _sink);
+	// Where the stats of each infection round go; null stops them.
+
+	static void workersRun(void *(*run)(void *), void *arg, U32 threads);
+	// Calls run(arg) on this thread and on up to threads - 1 new ones, and
+	// returns once all have.  Workers claim their work from arg, so what a
+	// thread that could not be started would have done falls to the rest.
+
+	void snapshotWrite(Fwk::String _path);
+	void snapshotRead(Fwk::String _path);
+	// Saves the tissue to a snapshot file, or rebuilds it from one without
+	// notifying the reactor cell by cell; the cell counters are set from
+	// the cells loaded.  The tissue must be empty to load.
+	Simulation::Ptr fork(Fwk::String _name);
+	// A new simulation, writing stats to the same sink, whose tissue starts
+	// as a copy of this one's, counters included.  The copy is made in one
+	// pass, without notifications or lookups, and the two are independent
+	// from then on.
+
+	void imageWrite(Fwk::String _path);
+	// Saves the tissue as an image to be used in place by a TissueImage.
+
 	Tissue::Ptr tissue();
 
 protected:
@@ -52,6 +109,8 @@ protected:
 		public:
 			virtual void onCellNew( Cell::Ptr );
 			virtual void onCellDel( Cell::Ptr );
+			virtual void onCellsNew( Tissue::CellVector const & cells );
+			virtual void onCellsDel( Tissue::CellVector const & cells );
 
 			static TissueReactor *TissueReactorIs(Tissue *t) {
 				return new TissueReactor(t);
@@ -61,17 +120,42 @@ protected:
 			TissueReactor(Tissue *t) : Tissue::Notifiee() {}
 	};
 
-	Simulation(Fwk::String _name);
+	Simulation(Fwk::String _name, Tissue::CellStorage _storage,
+	           StatsSink::Ptr _statsSink);
 	~Simulation() {}
 	Cell::Coordinates coordinateShifted(Cell::Coordinates loc, 
                                      CellMembrane::Side side);
-	bool infectionSpreadTo(Cell::Ptr c, CellMembrane::Side side, 
+	bool infectionSpreadTo(Cell *c, CellMembrane::Side side, 
                                    AntibodyStrength attack, 
                                    S32& difference,
                                    U32& attempts);
 	Cell::Ptr neighbor(Cell::Ptr c, CellMembrane::Side side);
 	CellMembrane::Side oppositeSide(CellMembrane::Side side);
 	void stats(U32 attempts, S32 difference, U32 path);
+	struct CloneShards;
+	static void *cloneShardsRun(void *arg);
+	void cloneShardsNew(vector<Cell *> const &sources, CellMembrane::Side side,
+	                    vector<Cell *> &clones);
+	struct InfectionBatch;
+	static void *infectionBatchRun(void *arg);
+	void infectionRun(InfectionRun const &run, Cell *root, 
+	                  InfectionStats &stats, Fwk::Bitset &infected, 
+	                  vector<Cell *> &cells);
+	void infectionRoundExpand(vector<Cell *>& curRound, 
+                            vector<Cell *>& nextRound,
+                            AntibodyStrength attack,
+                            S32& difference,
+                            U32& attempts);
+	void infectionRoundTopDown(vector<Cell *>& curRound, 
+                             vector<Cell *>& nextRound,
+                             AntibodyStrength attack,
+                             S32& difference,
+                             U32& attempts);
+	void infectionRoundBottomUp(vector<Cell *>& curRound, 
+                              vector<Cell *>& nextRound,
+                              AntibodyStrength attack,
+                              S32& difference,
+                              U32& attempts);
 
 	Tissue::Ptr tissue_;
 
@@ -79,6 +163,10 @@ protected:
 	U32 infectedCells(); 
 	U32 cytotoxicCells_;
 	U32 helperCells_;
+	U32 infectionThreads_;
+	StatsSink::Ptr statsSink_;
+	Fwk::Bitset frontier_;
+	vector<U32> frontierRank_;
 };
 
 #endif
@@ -0,0 +1,128 @@
+#include <string.h>
+#include "stats.h"
+
+using namespace std;
+
+StatsSink::StatsSink(Format _format, std::ostream *_out) :
+  format_(_format), out_(_out), flushInterval_(0), rounds_(0)
+{
+  buffer_.reserve(bufferSize);
+  if (!out_)
+    return;
+  if (format_ == csv_) {
+    static const char header[] =
+      "tissue,infected,attempts,difference,cytotoxic,helper,volume,path\n";
+    bytesNew(header, sizeof(header) - 1);
+  } else if (format_ == binary_) {
+    bytesNew(statsMagic, sizeof(statsMagic));
+    for (U32 i = 0; i < 4; i++)
+      buffer_.push_back(char(statsVersion >> (8 * i)));
+  }
+}
+
+StatsSink::~StatsSink()
+{
+  flush();
+}
+
+StatsSink::Ptr StatsSink::standardOut()
+{
+  static StatsSink::Ptr sink = StatsSinkNew(text_, &cout);
+  return sink;
+}
+
+// Writes a decimal number at p without going through a stream and
+// returns the end of it.
+static char *decimal(char *p, S64 value)
+{
+  char digits[24];
+  char *d = digits + sizeof(digits);
+  U64 magnitude = value < 0 ? -value : value;
+  do {
+    *--d = char('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+    *--d = '-';
+  U32 size = digits + sizeof(digits) - d;
+  memcpy(p, d, size);
+  return p + size;
+}
+
+static char *word(char *p, U32 value)
+{
+  for (U32 i = 0; i < 4; i++)
+    *p++ = char(value >> (8 * i));
+  return p;
+}
+
+void StatsSink::statsNew(Fwk::String const &tissue,
+                         InfectionStats const &stats)
+{
+  S64 value[] = {
+    stats.infectedCells, stats.attempts, stats.difference,
+    stats.cytotoxicCells, stats.helperCells, stats.volume, stats.path
+  };
+  static const U32 values = sizeof(value) / sizeof(value[0]);
+
+  // Each round is formatted on the stack and appended in one go.
+  char line[values * 24];
+  char *p = line;
+  switch (format_) {
+  case text_:
+    for (U32 i = 0; i < values; i++) {
+      if (i)
+        *p++ = ' ';
+      p = decimal(p, value[i]);
+    }
+    *p++ = '\n';
+    break;
+  case csv_:
+    bytesNew(tissue.data(), tissue.size());
+    for (U32 i = 0; i < values; i++) {
+      *p++ = ',';
+      p = decimal(p, value[i]);
+    }
+    *p++ = '\n';
+    break;
+  case binary_:
+    *p++ = char(tissue.size());
+    *p++ = char(tissue.size() >> 8);
+    bytesNew(line, p - line);
+    bytesNew(tissue.data(), tissue.size());
+    p = line;
+    for (U32 i = 0; i < values; i++)
+      p = word(p, U32(value[i]));
+    break;
+  }
+  buffer_.insert(buffer_.end(), line, p);
+  roundEnded();
+}
+
+void StatsSink::bytesNew(char const *data, U32 size)
+{
+  buffer_.insert(buffer_.end(), data, data + size);
+  if (out_ && buffer_.size() >= bufferSize)
+    flush();
+}
+
+void StatsSink::roundEnded()
+{
+  if (!out_)
+    return;
+  rounds_++;
+  if (buffer_.size() >= bufferSize ||
+      (flushInterval_ && rounds_ >= flushInterval_))
+    flush();
+}
+
+void StatsSink::flush()
+{
+  if (!out_)
+    return;
+  rounds_ = 0;
+  if (!buffer_.empty())
+    out_->write(&buffer_[0], buffer_.size());
+  out_->flush();
+  buffer_.clear();
+}
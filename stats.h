@@ -0,0 +1,104 @@
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+#include "fwk/Ptr.h"
+#include "fwk/PtrInterface.h"
+#include "fwk/String.h"
+#include "fwk/Types.h"
+
+/*
+  Where the statistics of infection rounds go.
+
+  A StatsSink formats each round into a buffer of its own and writes the
+  buffer to its stream only when it fills, every flushInterval rounds if
+  that is set, or on flush; nothing is flushed per line.  Output that must
+  appear in order with the stats, such as an error on cerr, has to flush
+  the sink first.
+
+  The format is one of
+    text_    the line the rules DSL has always printed:
+               infected attempts difference cytotoxic helper volume path
+    csv_     a header line, then tissue,infected,...,path per round
+    binary_  statsMagic and a version word, then per round a U16 name
+             size, the tissue name and the seven values as little-endian
+             32-bit words, in the text order
+  A sink without a stream keeps everything it is given in its buffer,
+  header excluded, for the caller to read with data and copy on with
+  bytesNew.
+
+  Sinks are referenced from simulations on every thread, standardOut
+  above all, so their reference counts are atomic.
+*/
+
+struct InfectionStats {
+  U32 infectedCells;
+  U32 attempts;
+  S32 difference;
+  U32 cytotoxicCells;
+  U32 helperCells;
+  U32 volume;
+  U32 path;
+};
+
+static const char statsMagic[4] = {'H', 'I', 'V', 'S'};
+static const U32 statsVersion = 1;
+
+class StatsSink :
+  public Fwk::PtrInterface<StatsSink, Fwk::AtomicReferences> {
+public:
+  typedef Fwk::Ptr<StatsSink const> PtrConst;
+  typedef Fwk::Ptr<StatsSink> Ptr;
+
+  enum Format {
+    text_,
+    csv_,
+    binary_
+  };
+  static Format text() { return text_; }
+  static Format csv() { return csv_; }
+  static Format binary() { return binary_; }
+
+  static StatsSink::Ptr StatsSinkNew(Format _format, std::ostream *_out) {
+    Ptr s = new StatsSink(_format, _out);
+    s->referencesDec(1);
+    return s;
+  }
+  // _out null keeps the stats in memory.
+
+  static StatsSink::Ptr standardOut();
+  // The text sink on cout that simulations use unless given another.
+
+  Format format() const { return format_; }
+  std::ostream *out() const { return out_; }
+
+  U32 flushInterval() const { return flushInterval_; }
+  void flushIntervalIs(U32 _rounds) { flushInterval_ = _rounds; }
+  // Rounds between flushes; 0 flushes only when the buffer fills.
+
+  U32 bytes() const { return buffer_.size(); }
+  char const *data() const { return buffer_.empty() ? 0 : &buffer_[0]; }
+  // What is buffered and not yet flushed.
+
+  void statsNew(Fwk::String const &tissue, InfectionStats const &stats);
+  void bytesNew(char const *data, U32 size);
+  // Appends stats already formatted by a sink of the same format.
+  void flush();
+
+  static const U32 bufferSize = 1 << 16;
+
+protected:
+  StatsSink(StatsSink const &);
+  StatsSink(Format _format, std::ostream *_out);
+  ~StatsSink();
+
+  void roundEnded();
+  Format format_;
+  std::ostream *out_;
+  U32 flushInterval_;
+  U32 rounds_;
+  std::vector<char> buffer_;
+};
+
+#endif
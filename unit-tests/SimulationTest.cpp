@@ -1,9 +1,12 @@
 #include "gtest/gtest.h"
 #include <fstream>
 #include <stdlib.h>
+#include <unistd.h>
 #include <queue>
 #include <iostream>
+#include "command.h"
 #include "simulation.h"
+#include "TissueImage.h"
 
 
 bool membraneStrength(Tissue::Ptr t, Cell::Coordinates loc,
@@ -274,3 +277,1154 @@ TEST(Simulation, infectedCellsDel)
   ASSERT_TRUE(c2.ptr() != NULL);
 
 }
+
+TEST(Simulation, cellDelByName)
+{
+  string tissue = "tissue1";
+  Simulation::Ptr sim = Simulation::SimulationNew(tissue);
+  Tissue::Ptr t = sim->tissue();
+
+  Cell::Coordinates loc = {-3, 7, 12};
+  sim->cellNew(loc, Cell::helperCell());
+  ASSERT_TRUE(t->cell(loc).ptr() != NULL);
+  ASSERT_TRUE(Cell::Coordinates::CoordinatesInstance(loc.name()) == loc);
+
+  ASSERT_TRUE(t->cellDel("(1,2)").ptr() == NULL);
+  ASSERT_TRUE(t->cellDel("tissue1").ptr() == NULL);
+  ASSERT_TRUE(t->cells() == 1);
+
+  ASSERT_TRUE(t->cellDel(loc.name()).ptr() != NULL);
+  ASSERT_TRUE(t->cell(loc).ptr() == NULL);
+  ASSERT_TRUE(t->cells() == 0);
+}
+
+TEST(Simulation, chunkedStorage)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1",
+    Tissue::chunkedStorage());
+  Tissue::Ptr t = sim->tissue();
+  ASSERT_TRUE(t->cellStorage() == Tissue::chunkedStorage());
+
+  // straddle the chunk boundary at x = 0
+  for (int i = -20; i < 20; i++) {
+    Cell::Coordinates loc = {i, 3, -1};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+  ASSERT_TRUE(t->cells() == 40);
+
+  U32 count = 0;
+  for (Tissue::CellIteratorConst it = t->cellIterConst(); it; ++it)
+    count++;
+  ASSERT_TRUE(count == 40);
+
+  Cell::Coordinates loc = {-1, 3, -1};
+  Cell::Ptr east = t->neighbor(loc, CellMembrane::east());
+  ASSERT_TRUE(east.ptr() != NULL);
+  ASSERT_TRUE(east->location().x == 0);
+  ASSERT_TRUE(t->neighbor(loc, CellMembrane::up()).ptr() == NULL);
+
+  t->cellDel(loc);
+  ASSERT_TRUE(t->cell(loc).ptr() == NULL);
+  ASSERT_TRUE(t->cells() == 39);
+}
+
+TEST(Simulation, neighborLinks)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+
+  Cell::Coordinates loc1 = {0, 0, 0};
+  Cell::Coordinates loc2 = {0, 1, 0};
+  Cell::Ptr c1 = sim->cellNew(loc1, Cell::helperCell());
+  ASSERT_TRUE(c1->neighbor(CellMembrane::north()) == NULL);
+
+  Cell::Ptr c2 = sim->cellNew(loc2, Cell::cytotoxicCell());
+  ASSERT_TRUE(c1->neighbor(CellMembrane::north()) == c2.ptr());
+  ASSERT_TRUE(c2->neighbor(CellMembrane::south()) == c1.ptr());
+  ASSERT_TRUE(c2->neighbor(CellMembrane::north()) == NULL);
+
+  t->cellDel(loc2);
+  ASSERT_TRUE(c1->neighbor(CellMembrane::north()) == NULL);
+  ASSERT_TRUE(c2->neighbor(CellMembrane::south()) == NULL);
+}
+
+TEST(Simulation, inlineMembranes)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Cell::Coordinates loc = {2, 2, 2};
+  Cell::Ptr c = sim->cellNew(loc, Cell::cytotoxicCell());
+  ASSERT_TRUE(c->membranes() == 6);
+  ASSERT_TRUE(c->antibodyStrength(CellMembrane::up()) == AntibodyStrength(100));
+
+  sim->antibodyStrengthIs(loc, CellMembrane::up(), AntibodyStrength(30));
+  CellMembrane::Ptr m = c->membrane(CellMembrane::up());
+  ASSERT_TRUE(m.ptr() != NULL);
+  ASSERT_TRUE(m->name() == "(2,2,2) up");
+  ASSERT_TRUE(m->antibodyStrength() == AntibodyStrength(30));
+
+  m->antibodyStrengthIs(AntibodyStrength(40));
+  ASSERT_TRUE(c->antibodyStrength(CellMembrane::up()) == AntibodyStrength(40));
+  ASSERT_TRUE(c->membrane(CellMembrane::up()).ptr() == m.ptr());
+
+  sim->tissue()->cellDel(loc);
+  c = 0;
+  ASSERT_TRUE(m->cell() == NULL);
+  ASSERT_TRUE(m->antibodyStrength() == AntibodyStrength(40));
+}
+
+TEST(Simulation, cellAllocator)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Fwk::SlabAllocator::PtrConst a = t->allocator();
+  ASSERT_TRUE(a->live() == 0);
+
+  for (int i = 0; i < 100; i++) {
+    Cell::Coordinates loc = {i, 0, 0};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+  ASSERT_TRUE(a->live() == 100);
+  ASSERT_TRUE(a->slabs() > 0);
+  U32 slabs = a->slabs();
+
+  for (int i = 0; i < 100; i++) {
+    Cell::Coordinates loc = {i, 0, 0};
+    t->cellDel(loc);
+  }
+  ASSERT_TRUE(a->live() == 0);
+
+  // freed cells are reused before any new slab is taken
+  for (int i = 0; i < 100; i++) {
+    Cell::Coordinates loc = {0, i, 0};
+    sim->cellNew(loc, Cell::cytotoxicCell());
+  }
+  ASSERT_TRUE(a->live() == 100);
+  ASSERT_TRUE(a->slabs() == slabs);
+  ASSERT_TRUE(a->bytes() == U64(slabs) * Fwk::SlabAllocator::slabBytes);
+}
+
+// A text sink that keeps its stats in memory, and what it holds.
+StatsSink::Ptr memorySink()
+{
+  return StatsSink::StatsSinkNew(StatsSink::text(), 0);
+}
+
+string sinkText(StatsSink::Ptr sink)
+{
+  return string(sink->data(), sink->bytes());
+}
+
+// A new empty file of this run's own, for the caller to unlink.
+string tempFile()
+{
+  char path[] = "/tmp/SimulationTestXXXXXX";
+  int fd = mkstemp(path);
+  if (fd >= 0)
+    close(fd);
+  return path;
+}
+
+string infectionStats(U32 threads)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  sim->infectionThreadsIs(threads);
+  U32 seed = 12345;
+  for (int x = 0; x < 24; x++)
+    for (int y = 0; y < 24; y++)
+      for (int z = 0; z < 24; z++) {
+        Cell::Coordinates loc = {x, y, z};
+        Cell::Ptr c = sim->cellNew(loc, Cell::helperCell());
+        for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++) {
+          seed = seed * 1103515245 + 12345;
+          c->antibodyStrengthIs(CellMembrane::Side(i), (seed >> 16) % 100);
+        }
+      }
+
+  StatsSink::Ptr out = memorySink();
+  sim->statsSinkIs(out);
+  Cell::Coordinates loc = {12, 12, 12};
+  sim->infectionStart(loc, CellMembrane::north(), AntibodyStrength(60));
+  return sinkText(out);
+}
+
+TEST(Simulation, parallelInfection)
+{
+  string serial = infectionStats(1);
+  ASSERT_TRUE(serial != "");
+  ASSERT_EQ(serial, infectionStats(4));
+}
+
+TEST(Simulation, denseCellIndex)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  for (int i = 0; i < 4; i++) {
+    Cell::Coordinates loc = {i, 0, 0};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+  Cell::Coordinates loc1 = {1, 0, 0};
+  Cell::Coordinates loc3 = {3, 0, 0};
+  t->cell(loc3)->healthIs(Cell::infected());
+  ASSERT_TRUE(t->infectedCells() == 1);
+
+  // deleting index 1 moves the last cell, and its infected bit, into it
+  t->cellDel(loc1);
+  ASSERT_TRUE(t->cells() == 3);
+  Cell::Ptr c3 = t->cell(loc3);
+  ASSERT_TRUE(c3->index() == 1);
+  ASSERT_TRUE(t->cellIndexed(1) == c3.ptr());
+  ASSERT_TRUE(t->infectedSet().bit(1));
+  ASSERT_TRUE(t->infectedCells() == 1);
+
+  t->cellDel(loc3);
+  ASSERT_TRUE(t->infectedCells() == 0);
+  ASSERT_TRUE(c3->index() == Cell::noIndex);
+}
+
+TEST(Simulation, strengthArrays)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Cell::Coordinates loc0 = {0, 0, 0};
+  Cell::Coordinates loc1 = {1, 0, 0};
+  sim->cellNew(loc0, Cell::helperCell());
+  sim->cellNew(loc1, Cell::cytotoxicCell());
+  ASSERT_TRUE(t->antibodyStrengths(CellMembrane::west())[0] == 0);
+  ASSERT_TRUE(t->antibodyStrengths(CellMembrane::west())[1] == 100);
+
+  sim->antibodyStrengthIs(loc1, CellMembrane::west(), AntibodyStrength(42));
+  ASSERT_TRUE(t->antibodyStrengths(CellMembrane::west())[1] == 42);
+
+  t->cellDel(loc0);
+  ASSERT_TRUE(t->antibodyStrengths(CellMembrane::west())[0] == 42);
+  ASSERT_TRUE(t->antibodyStrengths(CellMembrane::east())[0] == 100);
+}
+
+TEST(Simulation, infectionBoundingBox)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Cell::Coordinates a = {0, 0, 0};
+  Cell::Coordinates b = {2, 1, 0};
+  Cell::Coordinates c = {5, 3, 2};
+  sim->cellNew(a, Cell::helperCell())->healthIs(Cell::infected());
+  sim->cellNew(b, Cell::helperCell())->healthIs(Cell::infected());
+  sim->cellNew(c, Cell::helperCell());
+  ASSERT_TRUE(t->infectedCells() == 2);
+  ASSERT_TRUE(t->infectionVolume() == 3 * 2 * 1);
+
+  t->cell(c)->healthIs(Cell::infected());
+  ASSERT_TRUE(t->infectionVolume() == 6 * 4 * 3);
+
+  // removing a boundary cell shrinks the box
+  t->cellDel(c);
+  ASSERT_TRUE(t->infectionVolume() == 3 * 2 * 1);
+  t->cell(a)->healthIs(Cell::healthy());
+  ASSERT_TRUE(t->infectionVolume() == 1);
+  ASSERT_TRUE(t->infectedMin() == b);
+
+  sim->infectedCellsDel();
+  ASSERT_TRUE(t->infectedCells() == 0);
+  ASSERT_TRUE(t->infectionVolume() == 0);
+}
+
+TEST(Simulation, cloneCellsBulk)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Cell::Coordinates a = {0, 0, 0};
+  Cell::Coordinates b = {0, 1, 0};
+  Cell::Coordinates c = {3, 0, 0};
+  sim->cellNew(a, Cell::helperCell());
+  sim->cellNew(b, Cell::cytotoxicCell())->healthIs(Cell::infected());
+  sim->cellNew(c, Cell::helperCell());
+  sim->antibodyStrengthIs(b, CellMembrane::east(), AntibodyStrength(7));
+
+  // a's clone would land on b and is skipped; the rest are placed
+  sim->cloneCellsNew(CellMembrane::north());
+  ASSERT_TRUE(t->cells() == 5);
+  Cell::Coordinates b1 = {0, 2, 0};
+  Cell::Coordinates c1 = {3, 1, 0};
+  Cell::Ptr clone = t->cell(b1);
+  ASSERT_TRUE(clone);
+  ASSERT_TRUE(clone->health() == Cell::infected());
+  ASSERT_TRUE(clone->antibodyStrength(CellMembrane::east()) == 7);
+  ASSERT_TRUE(clone->neighbor(CellMembrane::south()) == t->cell(b).ptr());
+  ASSERT_TRUE(t->cell(c1)->neighbor(CellMembrane::south()) == t->cell(c).ptr());
+  ASSERT_TRUE(t->infectedCells() == 2);
+}
+
+static bool cellIsCytotoxic(Cell const *c)
+{
+  return c->cellType() == Cell::cytotoxicCell();
+}
+
+TEST(Simulation, cellsDelIf)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  for (S32 x = 0; x < 40; x++) {
+    Cell::Coordinates loc = {x, 0, 0};
+    sim->cellNew(loc, x % 3 ? Cell::helperCell() : Cell::cytotoxicCell());
+    sim->antibodyStrengthIs(loc, CellMembrane::up(), AntibodyStrength(x));
+  }
+  Cell::Coordinates far = {38, 0, 0};
+  t->cell(far)->healthIs(Cell::infected());
+
+  ASSERT_TRUE(t->cellsDelIf(cellIsCytotoxic) == 14);
+  ASSERT_TRUE(t->cells() == 26);
+  ASSERT_TRUE(t->infectedCells() == 1);
+  ASSERT_TRUE(t->infectionVolume() == 1);
+  for (U32 i = 0; i < t->cells(); i++) {
+    Cell *c = t->cellIndexed(i);
+    ASSERT_TRUE(c->index() == i);
+    ASSERT_TRUE(c->cellType() == Cell::helperCell());
+    ASSERT_TRUE(t->antibodyStrengths(CellMembrane::up())[i] == 
+                U8(c->location().x));
+  }
+  Cell::Coordinates one = {1, 0, 0};
+  Cell::Coordinates two = {2, 0, 0};
+  ASSERT_TRUE(t->cell(one)->neighbor(CellMembrane::east()) == 
+              t->cell(two).ptr());
+  ASSERT_TRUE(t->cell(two)->neighbor(CellMembrane::east()) == 0);
+
+  // the reactor sees one batch and keeps the cell counts right
+  sim->infectedCellsDel();
+  ASSERT_TRUE(t->cells() == 25);
+  ASSERT_TRUE(t->infectedCells() == 0);
+  ASSERT_TRUE(t->cellsDelIf(cellIsCytotoxic) == 0);
+}
+
+class BatchCounter : public Tissue::Notifiee
+{
+ public:
+  static BatchCounter *BatchCounterIs() { return new BatchCounter(); }
+  virtual void onCellNew(Cell::Ptr) { cellsNew++; }
+  virtual void onCellsNew(Tissue::CellVector const & cells) {
+    batchesNew++;
+    cellsNew += cells.size();
+  }
+  virtual void onCellDel(Cell::Ptr) { cellsDel++; }
+  U32 cellsNew, batchesNew, cellsDel;
+ protected:
+  BatchCounter() : cellsNew(0), batchesNew(0), cellsDel(0) {}
+};
+
+TEST(Simulation, notificationBatch)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Fwk::Ptr<BatchCounter> counter = BatchCounter::BatchCounterIs();
+  counter->notifierIs(t);
+  Cell::Coordinates a = {0, 0, 0};
+  Cell::Coordinates b = {1, 0, 0};
+  Cell::Ptr transient;
+  {
+    Tissue::NotificationBatch outer(t.ptr());
+    Tissue::NotificationBatch inner(t.ptr());
+    sim->cellNew(a, Cell::cytotoxicCell());
+    transient = sim->cellNew(b, Cell::helperCell());
+    t->cellDel(b);
+    ASSERT_TRUE(counter->cellsNew == 0 && counter->cellsDel == 0);
+  }
+  // b came and went within the batch, so only a is reported
+  ASSERT_TRUE(counter->batchesNew == 1);
+  ASSERT_TRUE(counter->cellsNew == 1);
+  ASSERT_TRUE(counter->cellsDel == 0);
+  // the simulation reactor gave the batch its membranes, and none to b
+  ASSERT_TRUE(t->cell(a)->antibodyStrength(CellMembrane::up()) == 
+              AntibodyStrength(100));
+  ASSERT_TRUE(transient->membranes() == 0);
+  {
+    Tissue::NotificationBatch batch(t.ptr());
+    t->cellDel(a);
+  }
+  // the default onCellsDel adapter reports each cell on its own
+  ASSERT_TRUE(counter->cellsDel == 1);
+  sim->cellNew(a, Cell::cytotoxicCell());
+
+  sim->cloneCellsNew(CellMembrane::north());
+  ASSERT_TRUE(counter->batchesNew == 2);
+  ASSERT_TRUE(counter->cellsNew == 3);
+  sim->cellNew(b, Cell::helperCell());
+  ASSERT_TRUE(counter->cellsNew == 4);
+}
+
+class MembraneCounter : public Cell::Notifiee
+{
+ public:
+  static MembraneCounter *MembraneCounterIs() { return new MembraneCounter(); }
+  virtual void onMembrane(CellMembrane::Side side) {
+    membranes++;
+    sides |= 1 << side;
+  }
+  virtual void onTissue() { tissues++; }
+  U32 membranes, sides, tissues;
+ protected:
+  MembraneCounter() : membranes(0), sides(0), tissues(0) {}
+};
+
+TEST(Simulation, deferredNotification)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  Tissue::Ptr t = sim->tissue();
+  Fwk::Ptr<BatchCounter> counter = BatchCounter::BatchCounterIs();
+  counter->notifierIs(t);
+  t->notificationDeferredIs(true);
+
+  Cell::Coordinates a = {0, 0, 0};
+  Cell::Coordinates b = {1, 0, 0};
+  Cell::Ptr c = sim->cellNew(a, Cell::helperCell());
+  sim->cellNew(b, Cell::cytotoxicCell());
+  ASSERT_TRUE(counter->cellsNew == 0);
+  // nothing delivered yet, so the reactor has not built membranes
+  ASSERT_TRUE(c->membranes() == 0);
+
+  t->notificationsDispatch();
+  ASSERT_TRUE(counter->batchesNew == 1);
+  ASSERT_TRUE(counter->cellsNew == 2);
+  ASSERT_TRUE(c->membranes() == 6);
+
+  // repeated changes to one membrane reach the notifiee once
+  Fwk::Ptr<MembraneCounter> m = MembraneCounter::MembraneCounterIs();
+  m->notifierIs(c);
+  c->membraneDel(CellMembrane::up());
+  c->membraneNew(CellMembrane::up(), AntibodyStrength(3));
+  c->membraneDel(CellMembrane::down());
+  ASSERT_TRUE(m->membranes == 0);
+  t->notificationDeferredIs(false);
+  ASSERT_TRUE(m->membranes == 2);
+  ASSERT_TRUE(m->sides == (1u << CellMembrane::up_ | 1u << CellMembrane::down_));
+
+  // back to synchronous delivery
+  t->cellDel(b);
+  ASSERT_TRUE(counter->cellsDel == 1);
+
+  // a cell leaving the tissue in deferred mode hears of it on dispatch
+  t->notificationDeferredIs(true);
+  t->cellDel(a);
+  ASSERT_TRUE(c->tissue() == 0);
+  ASSERT_TRUE(m->tissues == 0);
+  t->notificationsDispatch();
+  ASSERT_TRUE(m->tissues == 1);
+  ASSERT_TRUE(counter->cellsDel == 2);
+}
+
+TEST(Simulation, commandParser)
+{
+  // What the line reader accepted before commands were tokenized in place:
+  // 1 parsed, 0 skipped, -1 rejected.
+  struct { char const *line; int parsed; } cases[] = {
+    {"Tissue T1 helperCellNew +2 06 -0", 1},
+    {"Tissue T1 helperCellNew 2147483647 -2147483648 0", 1},
+    {"Tissue T1 helperCellNew 99999999999 0 0", -1},
+    {"Tissue T1 helperCellNew 2147483648 0 0", -1},
+    {"Tissue T1 helperCellNew 5x 0 0", -1},
+    {"Tissue T1 helperCellNew 1 0 0x", -1},
+    {"Tissue T1 helperCellNew 1\t0 0", -1},
+    {"Tissue\tT1 helperCellNew 1 0 0", -1},
+    {"Tissue T1 helperCellNew 1 0 0\r", -1},
+    {"Tissue T1 infectedCellsDel\r", -1},
+    {"\r", -1},
+    {"Tissue T1 helperCellNew 1 0 0 extra", 1},
+    {"Tissue T1 infectionStartLocationIs 0 0 0 north +60 extra", 1},
+    {"", 0},
+    {"# comment", 0},
+    {" # comment", -1},
+  };
+  CommandTissues tissues;
+  tissues.tissueIdNew("T1", 2);
+  CommandParser parser(&tissues);
+  for (U32 i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char const *line = cases[i].line;
+    Command cmd;
+    int parsed;
+    try {
+      parsed = parser.commandIs(line, line + strlen(line), cmd) ? 1 : 0;
+    }
+    catch (...) {
+      parsed = -1;
+    }
+    ASSERT_EQ(parsed, cases[i].parsed) << line;
+  }
+
+  Command cmd;
+  char const line[] = "Tissue T1 helperCellNew +2 06 -0";
+  parser.commandIs(line, line + strlen(line), cmd);
+  ASSERT_TRUE(cmd.loc.x == 2 && cmd.loc.y == 6 && cmd.loc.z == 0);
+}
+
+// Parses each line of rules as asgn1convert does, keeping a line that
+// does not parse as a malformed_ command.
+static vector<Command> commandsParse(char const *rules,
+                                     CommandTissues &tissues)
+{
+  CommandParser parser(&tissues);
+  vector<Command> cmds;
+  for (char const *next = rules; *next; next = strchr(next, '\n') + 1) {
+    char const *eol = strchr(next, '\n');
+    Command cmd;
+    try {
+      if (!parser.commandIs(next, eol, cmd))
+        continue;
+    }
+    catch (...) {
+      cmd.op = Command::malformed_;
+      cmd.text = next;
+      cmd.textSize = eol - next;
+    }
+    cmds.push_back(cmd);
+  }
+  return cmds;
+}
+
+TEST(Simulation, commandBinary)
+{
+  // one line per opcode, each in the form commandText gives it
+  char const rules[] =
+    "Tissue tissueNew T1\n"
+    "Tissue tissueNew T2 chunked\n"
+    "Tissue tissueNew T5 sharded\n"
+    "Tissue T1 cytotoxicCellNew 1 -2 3\n"
+    "Tissue T2 helperCellNew 0 0 -70000\n"
+    "Tissue T1 infectionStartLocationIs 1 -2 3 down 200\n"
+    "Tissue T1 infectedCellsDel\n"
+    "Tissue T2 infectionThreadsIs 4\n"
+    "Tissue T2 notificationDeferredIs true\n"
+    "Tissue T1 cloneCellsNew west\n"
+    "Tissue T1 snapshotWrite t1.snap\n"
+    "Tissue T2 snapshotRead t1.snap\n"
+    "Tissue T1 imageWrite t1.image\n"
+    "Tissue T1 fork T4\n"
+    "Tissue T1 infectionStartLocationsIs 200 1 -2 3 down 0 0 0 north\n"
+    "Cell T2 0 0 -70000 membrane up antibodyStrengthIs 0\n"
+    "Cell T1 1 -2 3 cloneNew south\n"
+    "Tissue T3 helperCellNew 0 0 0\n";
+  CommandTissues tissues;
+  vector<Command> cmds = commandsParse(rules, tissues);
+  // T3 was never created, so its line is kept as it was
+  ASSERT_TRUE(cmds.back().op == Command::malformed_);
+  vector<char> bin;
+  commandHeaderWrite(bin);
+  for (U32 i = 0; i < cmds.size(); i++)
+    commandWrite(cmds[i], bin);
+  char const *next = &bin[0];
+  char const *end = next + bin.size();
+  ASSERT_TRUE(commandBinary(next, end));
+
+  vector<bool> seen(Command::ops_);
+  char const *line = rules;
+  for (next += 8; next < end; line = strchr(line, '\n') + 1) {
+    Command cmd;
+    next = commandRead(next, end, cmd);
+    ASSERT_EQ(commandText(cmd, tissues), 
+              string(line, strchr(line, '\n') - line));
+    seen[cmd.op] = true;
+  }
+  ASSERT_TRUE(next == end && *line == 0);
+  for (U32 op = Command::tissueNew_; op < Command::ops_; op++)
+    ASSERT_TRUE(seen[op]) << "opcode " << op;
+
+  // a record cut short anywhere, or with an unknown opcode, is refused
+  for (U32 i = 0; i < cmds.size(); i++) {
+    vector<char> record;
+    commandWrite(cmds[i], record);
+    for (U32 size = 1; size < record.size(); size++) {
+      Command cmd;
+      ASSERT_ANY_THROW(commandRead(&record[0], &record[0] + size, cmd));
+    }
+  }
+  char const unknown[] = {0, char(Command::ops_)};
+  for (U32 i = 0; i < sizeof(unknown); i++) {
+    Command cmd;
+    ASSERT_ANY_THROW(commandRead(&unknown[i], &unknown[i] + 1, cmd));
+  }
+}
+
+TEST(Simulation, commandProgram)
+{
+  char const rules[] =
+    "Tissue tissueNew T1\n"
+    "Tissue T1 helperCellNew 0 0 0\n"
+    "Tissue T1 cloneCellsNew north\n"
+    "Tissue T2 helperCellNew 0 0 0\n"
+    "Tissue T1 infectionStartLocationIs 0 0 0 north 100\n"
+    "Tissue T1 infectedCellsDel\n"
+    "Tissue T1 infectionStartLocationIs 0 1 0 south 100\n";
+  stringstream first, second;  // outlive the program's sinks
+  CommandProgram program;
+  program.textCompile(rules, rules + strlen(rules));
+  ASSERT_EQ(program.commands(), 7u);
+  program.statsSinkIs(StatsSink::StatsSinkNew(StatsSink::text(), &first));
+  streambuf *err = cerr.rdbuf(first.rdbuf());
+  program.run();
+  // a replay runs against new simulations, so it prints the same again
+  program.statsSinkIs(StatsSink::StatsSinkNew(StatsSink::text(), &second));
+  cerr.rdbuf(second.rdbuf());
+  program.run();
+  cerr.rdbuf(err);
+  // T2 was never created: its command is reported, not run
+  ASSERT_TRUE(first.str().find("[Tissue T2 helperCellNew 0 0 0]") !=
+              string::npos);
+  ASSERT_TRUE(first.str().find("\n2 2 200 0 2 2 2\n0 0 0 0 0 0 0\n") !=
+              string::npos);
+  ASSERT_EQ(second.str(), first.str());
+}
+
+// Runs rules on threads, with stats and failure reports in one stream.
+string programOutput(char const *rules, U32 threads)
+{
+  stringstream out;  // outlives the program's sink
+  CommandProgram program;
+  program.textCompile(rules, rules + strlen(rules));
+  program.statsSinkIs(StatsSink::StatsSinkNew(StatsSink::text(), &out));
+  streambuf *err = cerr.rdbuf(out.rdbuf());
+  program.run(threads);
+  cerr.rdbuf(err);
+  return out.str();
+}
+
+TEST(Simulation, parallelTissues)
+{
+  char const rules[] =
+    "Tissue tissueNew T1\n"
+    "Tissue tissueNew T2\n"
+    "Tissue tissueNew T3\n"
+    "Tissue T1 helperCellNew 0 0 0\n"
+    "Tissue T2 cytotoxicCellNew 0 0 0\n"
+    "Tissue T3 helperCellNew 0 0 0\n"
+    "Cell T1 0 0 0 cloneNew north\n"
+    "Tissue T2 cloneCellsNew east\n"
+    "Tissue T3 cloneCellsNew up\n"
+    "Tissue T1 infectionStartLocationIs 0 0 0 south 100\n"
+    "Tissue T4 helperCellNew 0 0 0\n"
+    "Tissue T2 infectionStartLocationIs 1 0 0 west 120\n"
+    "Tissue T3 bogus\n"
+    "Tissue T3 infectionStartLocationIs 0 0 1 down 100\n"
+    "Tissue T2 cytotoxicCellNew 0 0 0\n"
+    "Tissue T1 cloneCellsNew west\n"
+    "Tissue T1 infectionStartLocationIs 0 1 0 north 100\n"
+    "Tissue T2 infectionStartLocationIs 0 0 0 west 100\n"
+    "Tissue T2 infectedCellsDel\n"
+    "Tissue T3 infectionStartLocationIs 0 0 0 up 100\n";
+  string serial = programOutput(rules, 1);
+  // stats of every tissue, with the failures reported among them
+  ASSERT_TRUE(serial.find("Tissue T4") != string::npos);
+  ASSERT_TRUE(serial.find("west 120") != string::npos);
+  ASSERT_TRUE(serial.find("bogus") != string::npos);
+  ASSERT_TRUE(serial.find("T2 cytotoxicCellNew") != string::npos);
+  ASSERT_TRUE(count(serial.begin(), serial.end(), '\n') == 9);
+  ASSERT_EQ(programOutput(rules, 2), serial);
+  ASSERT_EQ(programOutput(rules, 4), serial);
+}
+
+TEST(Simulation, statsSink)
+{
+  stringstream text, csv, binary;
+  StatsSink::Ptr t = StatsSink::StatsSinkNew(StatsSink::text(), &text);
+  StatsSink::Ptr c = StatsSink::StatsSinkNew(StatsSink::csv(), &csv);
+  StatsSink::Ptr b = StatsSink::StatsSinkNew(StatsSink::binary(), &binary);
+  InfectionStats s = {3, 9, -42, 2, 5, 8, 4};
+  t->statsNew("tissue1", s);
+  c->statsNew("tissue1", s);
+  b->statsNew("tissue1", s);
+  // buffered until flushed
+  ASSERT_EQ(text.str(), "");
+  t->flush();
+  c->flush();
+  b->flush();
+  ASSERT_EQ(text.str(), "3 9 -42 2 5 8 4\n");
+  ASSERT_EQ(csv.str(), "tissue,infected,attempts,difference,cytotoxic,"
+            "helper,volume,path\ntissue1,3,9,-42,2,5,8,4\n");
+  string bytes = binary.str();
+  ASSERT_TRUE(bytes.size() == 8 + 2 + 7 + 7 * 4);
+  ASSERT_EQ(bytes.substr(0, 4), "HIVS");
+  ASSERT_EQ(bytes.substr(10, 7), "tissue1");
+  ASSERT_TRUE(U8(bytes[17 + 2 * 4]) == 0xd6);
+
+  t->flushIntervalIs(2);
+  t->statsNew("tissue1", s);
+  ASSERT_EQ(text.str(), "3 9 -42 2 5 8 4\n");
+  t->statsNew("tissue1", s);
+  ASSERT_EQ(text.str(), "3 9 -42 2 5 8 4\n3 9 -42 2 5 8 4\n"
+            "3 9 -42 2 5 8 4\n");
+}
+
+TEST(Simulation, tissueSnapshot)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  for (int x = 0; x < 6; x++)
+    for (int y = 0; y < 6; y++) {
+      Cell::Coordinates loc = {x, y, 0};
+      sim->cellNew(loc, (x + y) % 3 ? Cell::helperCell() : 
+                   Cell::cytotoxicCell());
+    }
+  Tissue::Ptr t = sim->tissue();
+  Cell::Coordinates loc = {2, 3, 0};
+  t->cell(loc)->antibodyStrengthIs(CellMembrane::east(), AntibodyStrength(7));
+  t->cell(loc)->membraneDel(CellMembrane::up());
+  t->cell(loc)->healthIs(Cell::infected());
+
+  vector<char> snapshot;
+  t->snapshotWrite(snapshot);
+  ASSERT_TRUE(snapshot.size() == snapshotHeaderSize + 36 * snapshotCellSize);
+
+  Simulation::Ptr copy = Simulation::SimulationNew("tissue2", 
+                                                   Tissue::chunkedStorage());
+  Fwk::Ptr<BatchCounter> counter = BatchCounter::BatchCounterIs();
+  counter->notifierIs(copy->tissue());
+  string path = tempFile();
+  sim->snapshotWrite(path);
+  copy->snapshotRead(path);
+  unlink(path.c_str());
+  Tissue::Ptr u = copy->tissue();
+  ASSERT_TRUE(counter->cellsNew == 0);
+  ASSERT_TRUE(u->cells() == 36);
+  ASSERT_TRUE(u->infectedCells() == 1);
+  Cell::Ptr c = u->cell(loc);
+  ASSERT_EQ(c->name(), "(2,3,0)");
+  ASSERT_TRUE(c->antibodyStrength(CellMembrane::east()).value() == 7);
+  ASSERT_TRUE(!c->membraneExists(CellMembrane::up()));
+  ASSERT_TRUE(c->membranes() == 5);
+  ASSERT_TRUE(c->neighbor(CellMembrane::north())->location().y == 4);
+  for (U32 i = 0; i < t->cells(); i++)
+    ASSERT_TRUE(u->cellIndexed(i)->location() == 
+                t->cellIndexed(i)->location());
+
+  // the same infection gives the same stats, counters included
+  StatsSink::Ptr a = memorySink();
+  StatsSink::Ptr b = memorySink();
+  sim->statsSinkIs(a);
+  copy->statsSinkIs(b);
+  Cell::Coordinates start = {0, 0, 0};
+  sim->infectionStart(start, CellMembrane::north(), AntibodyStrength(50));
+  copy->infectionStart(start, CellMembrane::north(), AntibodyStrength(50));
+  ASSERT_EQ(sinkText(a), sinkText(b));
+
+  // only into an empty tissue, and never from a corrupt snapshot
+  ASSERT_THROW(u->snapshotRead(&snapshot[0], snapshot.size()), 
+               Fwk::NameInUseException);
+  Tissue::Ptr v = Tissue::TissueNew("tissue3");
+  vector<char> longer(snapshot);
+  longer.insert(longer.end(), 4, 0);
+  ASSERT_THROW(v->snapshotRead(&longer[0], longer.size()), 
+               Fwk::RangeException);
+  ASSERT_THROW(v->snapshotRead(&snapshot[0], snapshot.size() - 1), 
+               Fwk::RangeException);
+  vector<char> twice(snapshot);
+  memcpy(&twice[snapshotHeaderSize + 2 * snapshotCellSize], 
+         &twice[snapshotHeaderSize], 12);
+  ASSERT_THROW(v->snapshotRead(&twice[0], twice.size()), 
+               Fwk::NameInUseException);
+  snapshot[snapshotHeaderSize + 13] = 9;
+  ASSERT_THROW(v->snapshotRead(&snapshot[0], snapshot.size()), 
+               Fwk::RangeException);
+  ASSERT_TRUE(v->cells() == 0);
+
+  // a simulation reading a bad snapshot keeps its counters right
+  path = tempFile();
+  ofstream bad(path.c_str(), ios::binary);
+  bad.write(&twice[0], twice.size());
+  bad.close();
+  Simulation::Ptr empty = Simulation::SimulationNew("tissue4");
+  ASSERT_THROW(empty->snapshotRead(path), Fwk::NameInUseException);
+  unlink(path.c_str());
+  ASSERT_TRUE(empty->tissue()->cells() == 0);
+  StatsSink::Ptr none = memorySink();
+  empty->statsSinkIs(none);
+  empty->infectionStart(start, CellMembrane::north(), AntibodyStrength(50));
+  ASSERT_EQ(sinkText(none), "0 0 0 0 0 0 0\n");
+}
+
+TEST(Simulation, tissueImage)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  U32 seed = 777;
+  for (int x = -5; x < 7; x++)
+    for (int y = -3; y < 9; y++)
+      for (int z = 0; z < 6; z++) {
+        Cell::Coordinates loc = {x, y, z};
+        Cell::Ptr c = sim->cellNew(loc, (x + y + z) % 4 ? 
+                                   Cell::helperCell() : Cell::cytotoxicCell());
+        for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++) {
+          seed = seed * 1103515245 + 12345;
+          c->antibodyStrengthIs(CellMembrane::Side(i), (seed >> 16) % 100);
+        }
+      }
+  Cell::Coordinates gap = {1, 1, 1};
+  sim->tissue()->cellDel(gap);
+  string path = tempFile();
+  sim->imageWrite(path);
+
+  TissueImage::Ptr image = TissueImage::TissueImageNew(path);
+  Tissue::Ptr t = sim->tissue();
+  ASSERT_TRUE(image->cells() == t->cells());
+  ASSERT_TRUE(image->cell(gap) == TissueImage::noCell);
+  for (U32 i = 0; i < t->cells(); i++) {
+    Cell *c = t->cellIndexed(i);
+    U32 j = image->cell(c->location());
+    ASSERT_TRUE(j != TissueImage::noCell);
+    ASSERT_TRUE(image->location(j) == c->location());
+    ASSERT_TRUE(image->cellType(j) == c->cellType());
+    for (U32 s = CellMembrane::north_; s <= CellMembrane::down_; s++) {
+      CellMembrane::Side side = CellMembrane::Side(s);
+      ASSERT_TRUE(image->antibodyStrength(j, side) == 
+                  c->antibodyStrength(side));
+      U32 n = image->neighbor(j, side);
+      if (c->neighbor(side))
+        ASSERT_TRUE(image->location(n) == c->neighbor(side)->location());
+      else
+        ASSERT_TRUE(n == TissueImage::noCell);
+    }
+  }
+
+  // the same infections give the same stats
+  StatsSink::Ptr a = memorySink();
+  StatsSink::Ptr b = memorySink();
+  sim->statsSinkIs(a);
+  image->statsSinkIs(b);
+  Cell::Coordinates start = {0, 0, 0};
+  Cell::Coordinates other = {-5, 8, 5};
+  sim->infectionStart(start, CellMembrane::north(), AntibodyStrength(60));
+  image->infectionStart(start, CellMembrane::north(), AntibodyStrength(60));
+  sim->infectionStart(other, CellMembrane::up(), AntibodyStrength(90));
+  image->infectionStart(other, CellMembrane::up(), AntibodyStrength(90));
+  sim->infectionStart(gap, CellMembrane::up(), AntibodyStrength(90));
+  image->infectionStart(gap, CellMembrane::up(), AntibodyStrength(90));
+  ASSERT_EQ(sinkText(a), sinkText(b));
+  ASSERT_TRUE(image->infectedCells() > 1);
+
+  // changes stay in the overlay
+  U32 j = image->cell(start);
+  image->antibodyStrengthIs(j, CellMembrane::east(), AntibodyStrength(3));
+  ASSERT_TRUE(image->antibodyStrength(j, CellMembrane::east()).value() == 3);
+  TissueImage::Ptr fresh = TissueImage::TissueImageNew(path);
+  unlink(path.c_str());
+  ASSERT_TRUE(fresh->infectedCells() == 0);
+  ASSERT_TRUE(fresh->health(j) == Cell::healthy());
+  ASSERT_TRUE(fresh->antibodyStrength(j, CellMembrane::east()) == 
+              t->cell(start)->antibodyStrength(CellMembrane::east()));
+}
+
+TEST(Simulation, fork)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1", 
+                                                  Tissue::chunkedStorage());
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++) {
+      Cell::Coordinates loc = {x, y, 0};
+      sim->cellNew(loc, (x * y) % 5 ? Cell::helperCell() : 
+                   Cell::cytotoxicCell());
+    }
+  Cell::Coordinates sick = {7, 7, 0};
+  sim->tissue()->cell(sick)->healthIs(Cell::infected());
+
+  Simulation::Ptr child = sim->fork("tissue2");
+  Tissue::Ptr t = sim->tissue();
+  Tissue::Ptr u = child->tissue();
+  ASSERT_TRUE(u->cellStorage() == Tissue::chunkedStorage());
+  ASSERT_TRUE(u->cells() == t->cells());
+  ASSERT_TRUE(u->infectedCells() == 1);
+  for (U32 i = 0; i < t->cells(); i++) {
+    Cell *a = t->cellIndexed(i);
+    Cell *b = u->cellIndexed(i);
+    ASSERT_TRUE(a != b);
+    ASSERT_TRUE(b->tissue() == u.ptr());
+    ASSERT_TRUE(a->location() == b->location());
+    ASSERT_TRUE(u->cell(b->location()).ptr() == b);
+    for (U32 s = CellMembrane::north_; s <= CellMembrane::down_; s++) {
+      Cell *n = b->neighbor(CellMembrane::Side(s));
+      ASSERT_TRUE(!n == !a->neighbor(CellMembrane::Side(s)));
+      ASSERT_TRUE(!n || n->tissue() == u.ptr());
+    }
+  }
+
+  // an infection in the child gives the parent's stats and leaves it alone
+  StatsSink::Ptr a = memorySink();
+  StatsSink::Ptr b = memorySink();
+  child->statsSinkIs(b);
+  Cell::Coordinates start = {1, 1, 0};
+  child->infectionStart(start, CellMembrane::north(), AntibodyStrength(50));
+  ASSERT_TRUE(t->infectedCells() == 1);
+  ASSERT_TRUE(u->infectedCells() > 1);
+  sim->statsSinkIs(a);
+  sim->infectionStart(start, CellMembrane::north(), AntibodyStrength(50));
+  ASSERT_EQ(sinkText(a), sinkText(b));
+
+  // image forks share the mapping and nothing else
+  string path = tempFile();
+  sim->imageWrite(path);
+  TissueImage::Ptr image = TissueImage::TissueImageNew(path, 0);
+  unlink(path.c_str());
+  U32 j = image->cell(sick);
+  TissueImage::Ptr whatIf = image->fork();
+  ASSERT_TRUE(whatIf->file() == image->file());
+  whatIf->healthIs(j, Cell::healthy());
+  ASSERT_TRUE(image->health(j) == Cell::infected());
+  ASSERT_TRUE(whatIf->infectedCells() == image->infectedCells() - 1);
+}
+
+TEST(Simulation, infectionBatch)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  U32 seed = 4242;
+  for (int x = 0; x < 14; x++)
+    for (int y = 0; y < 14; y++)
+      for (int z = 0; z < 14; z++) {
+        Cell::Coordinates loc = {x, y, z};
+        Cell::Ptr c = sim->cellNew(loc, (x + y + z) % 5 ? 
+                                   Cell::helperCell() : Cell::cytotoxicCell());
+        for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++) {
+          seed = seed * 1103515245 + 12345;
+          c->antibodyStrengthIs(CellMembrane::Side(i), (seed >> 16) % 100);
+        }
+      }
+  Cell::Coordinates sick = {3, 4, 5};
+  sim->tissue()->cell(sick)->healthIs(Cell::infected());
+
+  vector<InfectionRun> runs;
+  for (U32 i = 0; i < 60; i++) {
+    seed = seed * 1103515245 + 12345;
+    InfectionRun r;
+    r.loc.x = (seed >> 8) % 16;
+    r.loc.y = (seed >> 12) % 14;
+    r.loc.z = (seed >> 16) % 14;
+    r.side = CellMembrane::Side((seed >> 20) % 6);
+    r.strength = AntibodyStrength((seed >> 4) % 101);
+    runs.push_back(r);
+  }
+  runs[0].loc = sick;
+
+  vector<InfectionStats> stats = sim->infectionBatch(runs, 4);
+  ASSERT_TRUE(stats.size() == runs.size());
+  ASSERT_TRUE(sim->tissue()->infectedCells() == 1);
+
+  U32 spread = 0;
+  for (U32 i = 0; i < stats.size(); i++)
+    spread = max(spread, stats[i].infectedCells);
+  ASSERT_TRUE(spread > 100);
+
+  StatsSink::Ptr batch = memorySink();
+  StatsSink::Ptr serial = memorySink();
+  for (U32 i = 0; i < runs.size(); i++) {
+    batch->statsNew("tissue1", stats[i]);
+    Simulation::Ptr fresh = sim->fork("fresh");
+    fresh->statsSinkIs(serial);
+    fresh->infectionStart(runs[i].loc, runs[i].side, runs[i].strength);
+  }
+  ASSERT_EQ(sinkText(batch), sinkText(serial));
+}
+
+TEST(Simulation, infectionSeeds)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1");
+  StatsSink::Ptr sink = StatsSink::StatsSinkNew(StatsSink::text(), 0);
+  sim->statsSinkIs(sink);
+  for (int x = 0; x < 10; x++) {
+    Cell::Coordinates loc = {x, 0, 0};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+
+  // Seeds at both ends meet in the middle: path counts rounds from the
+  // nearest seed.  A missing cell and an infected one are not attempted.
+  vector<InfectionSeed> seeds(4);
+  Cell::Coordinates end0 = {0, 0, 0}, end9 = {9, 0, 0}, none = {0, 5, 0};
+  seeds[0].loc = end0;
+  seeds[0].side = CellMembrane::west();
+  seeds[1].loc = none;
+  seeds[1].side = CellMembrane::west();
+  seeds[2].loc = end9;
+  seeds[2].side = CellMembrane::east();
+  seeds[3] = seeds[0];
+  sim->infectionStart(seeds, AntibodyStrength(50));
+  ASSERT_EQ(string(sink->data(), sink->bytes()), "10 10 500 0 10 10 5\n");
+
+  // One seed runs as infectionStart from that root.
+  sim->infectedCellsDel();
+  for (int x = 0; x < 10; x++) {
+    Cell::Coordinates loc = {x, 0, 0};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+  StatsSink::Ptr single = StatsSink::StatsSinkNew(StatsSink::text(), 0);
+  sim->statsSinkIs(single);
+  sim->infectionStart(vector<InfectionSeed>(1, seeds[0]), AntibodyStrength(50));
+  sim->infectedCellsDel();
+  for (int x = 0; x < 10; x++) {
+    Cell::Coordinates loc = {x, 0, 0};
+    sim->cellNew(loc, Cell::helperCell());
+  }
+  sim->infectionStart(end0, CellMembrane::west(), AntibodyStrength(50));
+  ASSERT_EQ(string(single->data(), single->bytes()),
+            "10 10 500 0 10 10 10\n10 10 500 0 10 10 10\n");
+}
+
+// One thread's share of the shardedStorage test: the cells of one slab
+// of x, added, infected and partly deleted, or given strengths, while
+// other slabs change too.
+struct ShardedSlab {
+  Tissue *tissue;
+  int x;
+  bool strengths;
+};
+
+static void *shardedSlabRun(void *arg)
+{
+  ShardedSlab *s = static_cast<ShardedSlab *>(arg);
+  for (int x = s->x; x < s->x + 16; x++)
+    for (int y = 0; y < 4; y++)
+      for (int z = 0; z < 4; z++) {
+        Cell::Coordinates loc = {x, y, z};
+        if (s->strengths) {
+          Cell::Ptr c = s->tissue->cell(loc);
+          if (c) {
+            c->antibodyStrengthIs(CellMembrane::east(), x & 63);
+            if (x % 6 == 0)
+              c->healthIs(Cell::healthy());
+          }
+          continue;
+        }
+        Cell::Ptr c = Cell::CellNew(loc, s->tissue, Cell::helperCell());
+        s->tissue->cellIs(c);
+        if (x % 3 == 0)
+          c->healthIs(Cell::infected());
+      }
+  for (int x = s->x; x < s->x + 16 && !s->strengths; x++) {
+    Cell::Coordinates loc = {x, 3, 3};
+    s->tissue->cellDel(loc);
+  }
+  return 0;
+}
+
+TEST(Simulation, shardedStorage)
+{
+  Simulation::Ptr sim = Simulation::SimulationNew("tissue1",
+    Tissue::shardedStorage());
+  Tissue::Ptr t = sim->tissue();
+  ASSERT_TRUE(t->cellStorage() == Tissue::shardedStorage());
+
+  // Four slabs around x = 0, each changed by a thread of its own; the
+  // neighbor links between slabs cross shards.  Cells are added in a
+  // batch, and given strengths, and some healed, once the reactor has made
+  // their membranes.
+  vector<ShardedSlab> slab(4);
+  vector<pthread_t> tid(slab.size());
+  for (U32 pass = 0; pass < 2; pass++) {
+    Tissue::NotificationBatch batch(t.ptr());
+    for (U32 i = 0; i < slab.size(); i++) {
+      slab[i].tissue = t.ptr();
+      slab[i].x = -32 + 16 * int(i);
+      slab[i].strengths = pass == 1;
+      pthread_create(&tid[i], 0, shardedSlabRun, &slab[i]);
+    }
+    for (U32 i = 0; i < slab.size(); i++)
+      pthread_join(tid[i], 0);
+  }
+  ASSERT_EQ(t->cells(), 64u * 15);
+
+  U32 count = 0, infected = 0;
+  for (Tissue::CellIteratorConst it = t->cellIterConst(); it; ++it) {
+    Cell const *c = it.ptr();
+    count++;
+    if (c->health() == Cell::infected())
+      infected++;
+    ASSERT_TRUE(t->cellIndexed(c->index()) == c);
+    ASSERT_EQ(t->antibodyStrengths(CellMembrane::east())[c->index()],
+              c->location().x & 63);
+    ASSERT_EQ(t->infectedSet().bit(c->index()), 
+              c->health() == Cell::infected());
+    for (U32 i = CellMembrane::north_; i <= CellMembrane::down_; i++) {
+      CellMembrane::Side side = CellMembrane::Side(i);
+      ASSERT_TRUE(c->neighbor(side) == 
+                  t->neighbor(c->location(), side).ptr());
+    }
+  }
+  ASSERT_EQ(count, t->cells());
+  ASSERT_EQ(infected, t->infectedCells());
+
+  // A parallel cloneCellsNew on a sharded tissue ends as a serial one
+  // on a hashed tissue does.
+  StatsSink::Ptr sharded = memorySink();
+  StatsSink::Ptr hashed = memorySink();
+  Simulation::Ptr a = Simulation::SimulationNew("a", Tissue::shardedStorage(),
+                                                sharded);
+  Simulation::Ptr b = Simulation::SimulationNew("b", Tissue::hashedStorage(),
+                                                hashed);
+  a->infectionThreadsIs(4);
+  for (int x = -20; x < 20; x++) {
+    Cell::Coordinates loc = {x, x % 5, 0};
+    a->cellNew(loc, x % 7 ? Cell::helperCell() : Cell::cytotoxicCell());
+    b->cellNew(loc, x % 7 ? Cell::helperCell() : Cell::cytotoxicCell());
+    a->antibodyStrengthIs(loc, CellMembrane::north(), AntibodyStrength(x + 40));
+    b->antibodyStrengthIs(loc, CellMembrane::north(), AntibodyStrength(x + 40));
+  }
+  for (U32 i = 0; i < 6; i++) {
+    a->cloneCellsNew(CellMembrane::Side(i));
+    b->cloneCellsNew(CellMembrane::Side(i));
+  }
+  ASSERT_EQ(a->tissue()->cells(), b->tissue()->cells());
+  Cell::Coordinates root = {3, 3, 0};
+  a->infectionStart(root, CellMembrane::north(), AntibodyStrength(50));
+  b->infectionStart(root, CellMembrane::north(), AntibodyStrength(50));
+  ASSERT_EQ(sinkText(sharded), sinkText(hashed));
+}
+
+// An object referenced from several threads at once.  It counts the times
+// its references reach zero instead of deleting itself.
+class SharedCount :
+  public Fwk::PtrInterface<SharedCount, Fwk::AtomicReferences> {
+public:
+  SharedCount() : zeros(0) {}
+  U32 zeros;
+protected:
+  void onZeroReferences() { __atomic_add_fetch(&zeros, 1, __ATOMIC_RELAXED); }
+};
+
+// One thread's share of the atomicReferences test: takes and drops
+// references, then drops the one it was handed if it owns one.
+struct SharedChurn {
+  SharedCount *shared;
+  bool owns;
+};
+
+static void *sharedChurnRun(void *arg)
+{
+  SharedChurn *c = static_cast<SharedChurn *>(arg);
+  for (U32 i = 0; i < 100000; i++) {
+    Fwk::Ptr<SharedCount> p(c->shared);
+    Fwk::Ptr<SharedCount> q(p);
+  }
+  if (c->owns)
+    c->shared->deleteRef();
+  return 0;
+}
+
+TEST(Simulation, atomicReferences)
+{
+  SharedCount shared;
+  vector<SharedChurn> churn(4);
+  vector<pthread_t> tid(churn.size());
+
+  // while this thread holds its reference, the others' come and go
+  for (U32 i = 0; i < churn.size(); i++) {
+    churn[i].shared = &shared;
+    churn[i].owns = false;
+    ASSERT_EQ(0, pthread_create(&tid[i], 0, sharedChurnRun, &churn[i]));
+  }
+  for (U32 i = 0; i < churn.size(); i++)
+    pthread_join(tid[i], 0);
+  ASSERT_EQ(1u, shared.references());
+  ASSERT_EQ(0u, shared.zeros);
+
+  // handed a reference each, the threads outlive this thread's, and
+  // whichever drops the last reaches zero once
+  for (U32 i = 0; i < churn.size(); i++) {
+    shared.newRef();
+    churn[i].owns = true;
+    ASSERT_EQ(0, pthread_create(&tid[i], 0, sharedChurnRun, &churn[i]));
+  }
+  shared.deleteRef();
+  for (U32 i = 0; i < churn.size(); i++)
+    pthread_join(tid[i], 0);
+  ASSERT_EQ(0u, shared.references());
+  ASSERT_EQ(1u, shared.zeros);
+}